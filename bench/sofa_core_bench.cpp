@@ -0,0 +1,829 @@
+// Benchmarks for sofa_core: feed parse (and an nlohmann DOM parse to compare
+// with), which builds the index, compact index serialization and load, and
+// model lookups, plus an optional fetch from a URL (usually a sofa_mirror
+// --replay serving recorded fixtures).
+//
+// Usage: sofa_core_bench [--iterations N] [--url URL] [--save FILE]
+//                        [--compare FILE] [--threshold PCT]
+//                        [--mirror SOFA_MIRROR [--clients N] [--duration SECONDS]] FEED
+//
+// --mirror load-tests a sofa_mirror: it serves FEED from a second
+// sofa_mirror --replay standing in for upstream, and N clients on
+// keep-alive connections fetch the JSON feed and the compact index from it
+// for SECONDS each, with and without gzip. Each run reports requests per
+// second and the p50 and p99 latency.
+//
+// The memory budget of low-memory refreshes is checked by
+// macos_compatibility_test, which runs them through the extension's
+// FeedDownload.
+//
+// Built as macos_compatibility_bench (with the osquery SDK) the suite also
+// times repeated macos_compatibility queries on an unchanged feed and the
+// extension's per-query bookkeeping: the feed counters, the rate limited log
+// in its suppressed and emitted paths, and the periodic summary.
+//
+// On Linux each benchmark also reports hardware counters per operation
+// from perf_event_open: cycles, instructions, cache and branch misses.
+// Counters the kernel does not allow (see perf_event_paranoid) are left
+// out.
+//
+// --save stores the results as a JSON baseline. --compare reruns the suite
+// against a stored baseline and exits 1 when a benchmark regressed: its
+// median is more than PCT percent slower and its 95% confidence interval
+// no longer overlaps the baseline's, or it allocates more per operation.
+
+#include "sofa_core.h"
+
+#ifdef MACOS_COMPATIBILITY_BENCH_EXTENSION
+// The extension's classes are private to its translation unit
+#include "../src/macos_compatibility.cpp"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+#include <nlohmann/json.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace osquery;
+using json = nlohmann::json;
+
+// Every operator new in the process is counted so allocations per
+// operation can be reported. libcurl allocates with malloc and is not.
+static std::atomic<uint64_t> allocation_count{0};
+static std::atomic<uint64_t> allocation_bytes{0};
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// Not inlined, so GCC does not pair the free() with a new expression and
+// warn about a mismatch (-Wmismatched-new-delete)
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+const size_t kDefaultIterations = 50;
+const double kDefaultThreshold = 10.0;
+const unsigned kDefaultClients = 8;
+const double kDefaultDuration = 5.0;
+
+// Hardware counters around the timed calls. Each counter is opened on its
+// own so one the kernel refuses does not take the others with it.
+class HardwareCounters {
+ public:
+    static constexpr size_t kCount = 4;
+    static constexpr const char* kNames[kCount] = {"cycles", "instructions", "cache_misses",
+                                                   "branch_misses"};
+
+    HardwareCounters() {
+        fds_.fill(-1);
+#ifdef __linux__
+        static constexpr uint64_t kConfigs[kCount] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+        for (size_t i = 0; i < kCount; i++) {
+            struct perf_event_attr attr = {};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = kConfigs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds_[i] < 0 && error_.empty()) {
+                error_ = std::string(kNames[i]) + ": " + strerror(errno);
+            }
+        }
+#else
+        error_ = "perf_event_open is Linux only";
+#endif
+    }
+
+    ~HardwareCounters() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    bool available(size_t counter) const { return fds_[counter] >= 0; }
+
+    // Why a counter is missing, empty if all are available
+    const std::string& error() const { return error_; }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Stop counting and add the counts since start() to totals
+    void stop(std::array<uint64_t, kCount>& totals) {
+#ifdef __linux__
+        for (size_t i = 0; i < kCount; i++) {
+            uint64_t value = 0;
+            if (fds_[i] >= 0) {
+                ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fds_[i], &value, sizeof(value)) == sizeof(value)) {
+                    totals[i] += value;
+                }
+            }
+        }
+#else
+        (void)totals;
+#endif
+    }
+
+ private:
+    std::array<int, kCount> fds_;
+    std::string error_;
+};
+
+struct Result {
+    std::string name;
+    size_t samples = 0;
+    double median_ns = 0;
+    // 95% confidence interval of the median
+    double ci_low_ns = 0;
+    double ci_high_ns = 0;
+    double allocs_per_op = 0;
+    double bytes_per_op = 0;
+    // Per operation, negative where the counter is unavailable
+    std::array<double, HardwareCounters::kCount> counters;
+};
+
+// Keeps a result the compiler could otherwise drop as unused, without
+// storing it anywhere
+template <typename T>
+void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Benchmark {
+    std::string name;
+    // Operations done by one call of body, so results are per operation
+    size_t ops = 1;
+    // Untimed work before each call of body, such as copying the input
+    std::function<void()> prepare;
+    std::function<void()> body;
+};
+
+// Median of sorted samples with a distribution-free 95% confidence
+// interval from the order statistics around it
+void summarize(std::vector<double> samples, Result& result) {
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    result.samples = n;
+    result.median_ns = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    double spread = 0.98 * std::sqrt(static_cast<double>(n));
+    auto low = static_cast<long>(std::floor(n / 2.0 - spread));
+    auto high = static_cast<long>(std::ceil(n / 2.0 + spread));
+    result.ci_low_ns = samples[std::max(0L, low)];
+    result.ci_high_ns = samples[std::min(static_cast<long>(n) - 1, high)];
+}
+
+Result run(const Benchmark& benchmark, size_t iterations, HardwareCounters& hardware) {
+    std::vector<double> samples;
+    samples.reserve(iterations);
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    std::array<uint64_t, HardwareCounters::kCount> counts = {};
+    for (size_t i = 0; i < iterations; i++) {
+        if (benchmark.prepare) {
+            benchmark.prepare();
+        }
+        uint64_t count_before = allocation_count.load();
+        uint64_t bytes_before = allocation_bytes.load();
+        hardware.start();
+        auto start = std::chrono::steady_clock::now();
+        benchmark.body();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        hardware.stop(counts);
+        allocations += allocation_count.load() - count_before;
+        bytes += allocation_bytes.load() - bytes_before;
+        samples.push_back(std::chrono::duration<double, std::nano>(elapsed).count() /
+                          benchmark.ops);
+    }
+
+    Result result;
+    result.name = benchmark.name;
+    summarize(std::move(samples), result);
+    double ops = static_cast<double>(iterations) * benchmark.ops;
+    result.allocs_per_op = allocations / ops;
+    result.bytes_per_op = bytes / ops;
+    for (size_t i = 0; i < HardwareCounters::kCount; i++) {
+        result.counters[i] = hardware.available(i) ? counts[i] / ops : -1;
+    }
+    return result;
+}
+
+std::string formatTime(double ns) {
+    char out[32];
+    if (ns >= 1e6) {
+        snprintf(out, sizeof(out), "%.2f ms", ns / 1e6);
+    } else if (ns >= 1e3) {
+        snprintf(out, sizeof(out), "%.2f us", ns / 1e3);
+    } else {
+        snprintf(out, sizeof(out), "%.1f ns", ns);
+    }
+    return out;
+}
+
+void print(const Result& result) {
+    printf("%-14s %12s  [%s, %s]  %10.1f allocs/op %12.0f bytes/op\n", result.name.c_str(),
+           formatTime(result.median_ns).c_str(), formatTime(result.ci_low_ns).c_str(),
+           formatTime(result.ci_high_ns).c_str(), result.allocs_per_op, result.bytes_per_op);
+    std::string line;
+    for (size_t i = 0; i < HardwareCounters::kCount; i++) {
+        if (result.counters[i] >= 0) {
+            char value[64];
+            snprintf(value, sizeof(value), "  %.0f %s/op", result.counters[i],
+                     HardwareCounters::kNames[i]);
+            line += value;
+        }
+    }
+    if (result.counters[0] > 0 && result.counters[1] >= 0) {
+        char ipc[32];
+        snprintf(ipc, sizeof(ipc), "  %.2f IPC", result.counters[1] / result.counters[0]);
+        line += ipc;
+    }
+    if (!line.empty()) {
+        printf("%14s%s\n", "", line.c_str());
+    }
+}
+
+json toJson(const std::vector<Result>& results) {
+    json benchmarks = json::object();
+    for (const auto& result : results) {
+        json entry = {
+            {"samples", result.samples},
+            {"median_ns", result.median_ns},
+            {"ci_low_ns", result.ci_low_ns},
+            {"ci_high_ns", result.ci_high_ns},
+            {"allocs_per_op", result.allocs_per_op},
+            {"bytes_per_op", result.bytes_per_op},
+        };
+        // Counters are recorded for reference; they vary too much across
+        // machines to compare against
+        for (size_t i = 0; i < HardwareCounters::kCount; i++) {
+            if (result.counters[i] >= 0) {
+                entry[std::string(HardwareCounters::kNames[i]) + "_per_op"] = result.counters[i];
+            }
+        }
+        benchmarks[result.name] = entry;
+    }
+    return {{"version", 1}, {"benchmarks", benchmarks}};
+}
+
+// Compare against a stored baseline; returns the number of regressions
+int compare(const std::vector<Result>& results, const json& baseline, double threshold) {
+    int regressions = 0;
+    const auto& stored = baseline.at("benchmarks");
+    for (const auto& result : results) {
+        if (!stored.contains(result.name)) {
+            printf("%-14s not in baseline\n", result.name.c_str());
+            continue;
+        }
+        const auto& base = stored.at(result.name);
+        double base_median = base.at("median_ns").get<double>();
+        double change = base_median > 0 ? (result.median_ns / base_median - 1) * 100 : 0;
+        bool slower = change > threshold && result.ci_low_ns > base.at("ci_high_ns").get<double>();
+        double base_allocs = base.at("allocs_per_op").get<double>();
+        bool allocates_more = result.allocs_per_op > base_allocs * (1 + threshold / 100) + 0.5;
+        printf("%-14s %12s vs %12s  %+6.1f%%  %8.1f vs %8.1f allocs/op  %s\n",
+               result.name.c_str(), formatTime(result.median_ns).c_str(),
+               formatTime(base_median).c_str(), change, result.allocs_per_op, base_allocs,
+               slower || allocates_more ? "REGRESSED" : "ok");
+        if (slower || allocates_more) {
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+size_t appendBody(char* data, size_t size, size_t count, void* out) {
+    static_cast<std::string*>(out)->append(data, size * count);
+    return size * count;
+}
+
+bool fetch(CURL* curl, const std::string& url, std::string& body) {
+    body.clear();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, appendBody);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    long status = 0;
+    return curl_easy_perform(curl) == CURLE_OK &&
+           curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK &&
+           status == 200;
+}
+
+bool readFile(const std::string& path, std::string& text) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+    out << in.rdbuf();
+    text = out.str();
+    return static_cast<bool>(in);
+}
+
+// A sofa_mirror child process on a free local port, stopped when this
+// object goes away
+class MirrorProcess {
+ public:
+    MirrorProcess(const std::string& path, std::vector<std::string> args) {
+        port_ = freePort();
+        args.insert(args.begin(), {path, "--bind", "127.0.0.1", "--port", std::to_string(port_)});
+        pid_ = fork();
+        if (pid_ == 0) {
+#ifdef __linux__
+            // Do not outlive a benchmark that crashed
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            std::vector<char*> argv;
+            for (auto& arg : args) {
+                argv.push_back(&arg[0]);
+            }
+            argv.push_back(nullptr);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+    }
+    MirrorProcess(const MirrorProcess&) = delete;
+    MirrorProcess& operator=(const MirrorProcess&) = delete;
+
+    ~MirrorProcess() {
+        if (pid_ > 0) {
+            kill(pid_, SIGTERM);
+            waitpid(pid_, nullptr, 0);
+        }
+    }
+
+    std::string url(const std::string& path) const {
+        return "http://127.0.0.1:" + std::to_string(port_) + path;
+    }
+
+    // Wait until path is served with a 200; false after five seconds
+    bool waitFor(const std::string& path) const {
+        CURL* curl = curl_easy_init();
+        std::string body;
+        bool ready = false;
+        for (int i = 0; i < 100 && !ready; i++) {
+            ready = fetch(curl, url(path), body);
+            if (!ready) {
+                usleep(50 * 1000);
+            }
+        }
+        curl_easy_cleanup(curl);
+        return ready;
+    }
+
+ private:
+    static uint16_t freePort() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t size = sizeof(addr);
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &size);
+        close(fd);
+        return ntohs(addr.sin_port);
+    }
+
+    uint16_t port_ = 0;
+    pid_t pid_ = -1;
+};
+
+size_t discardBody(char*, size_t size, size_t count, void* bytes) {
+    *static_cast<uint64_t*>(bytes) += size * count;
+    return size * count;
+}
+
+// Requests and latencies of one client
+struct ClientLoad {
+    std::vector<double> latencies_ns;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+};
+
+// Fetch url over one keep-alive connection until the deadline. With gzip
+// the compressed body is asked for and counted as it arrives, so the client
+// does not spend time inflating it.
+void runClient(const std::string& url,
+               bool gzip,
+               std::chrono::steady_clock::time_point deadline,
+               ClientLoad& load) {
+    CURL* curl = curl_easy_init();
+    struct curl_slist* headers = nullptr;
+    if (gzip) {
+        headers = curl_slist_append(headers, "Accept-Encoding: gzip");
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discardBody);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &load.bytes);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto start = std::chrono::steady_clock::now();
+        long status = 0;
+        bool ok = curl_easy_perform(curl) == CURLE_OK &&
+                  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK &&
+                  status == 200;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (ok) {
+            load.latencies_ns.push_back(std::chrono::duration<double, std::nano>(elapsed).count());
+        } else {
+            load.errors++;
+        }
+    }
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+}
+
+// Load-test a sofa_mirror serving the feed at feed_path. Returns false when
+// the mirror could not be started or a request failed.
+bool benchMirror(const std::string& mirror_path,
+                 const std::string& feed_path,
+                 const std::string& feed_text,
+                 unsigned clients,
+                 double seconds) {
+    char dir_template[] = "/tmp/sofa_bench.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        fprintf(stderr, "Cannot create a fixture directory\n");
+        return false;
+    }
+    std::string dir = dir_template;
+    std::string fixture_path = dir + "/upstream.fixture";
+    HttpFixture upstream;
+    upstream.url = "http://upstream/v1/macos_data_feed.json";
+    upstream.status = 200;
+    upstream.etag = "\"upstream\"";
+    upstream.content_type = "application/json";
+    upstream.body = feed_text;
+    {
+        std::ofstream out(fixture_path, std::ios::binary);
+        out << upstream.encode();
+    }
+
+    // The mirror retries a failed first fetch only after seconds, so
+    // upstream has to be up before it starts. It then answers 503 until that
+    // fetch is indexed.
+    MirrorProcess replay(mirror_path, {"--replay", dir, "--replay-speed", "0"});
+    bool ready = replay.waitFor("/v1/macos_data_feed.json");
+    std::unique_ptr<MirrorProcess> mirror;
+    if (ready) {
+        mirror = std::make_unique<MirrorProcess>(
+            mirror_path, std::vector<std::string>{"--upstream",
+                                                  replay.url("/v1/macos_data_feed.json"),
+                                                  "--workers", std::to_string(clients)});
+        ready = mirror->waitFor("/v1/macos_data_feed.bin");
+    }
+    unlink(fixture_path.c_str());
+    rmdir(dir.c_str());
+    if (!ready) {
+        fprintf(stderr, "sofa_mirror did not serve %s\n", feed_path.c_str());
+        return false;
+    }
+
+    printf("\nsofa_mirror, %u keep-alive clients for %.1fs per run:\n", clients, seconds);
+    bool ok = true;
+    for (const char* path : {"/v1/macos_data_feed.json", "/v1/macos_data_feed.bin"}) {
+        for (bool gzip : {false, true}) {
+            std::vector<ClientLoad> loads(clients);
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                        std::chrono::duration<double>(seconds));
+            for (auto& load : loads) {
+                threads.emplace_back(runClient, mirror->url(path), gzip, deadline,
+                                     std::ref(load));
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                           start)
+                                 .count();
+
+            std::vector<double> latencies;
+            uint64_t bytes = 0;
+            uint64_t errors = 0;
+            for (const auto& load : loads) {
+                latencies.insert(latencies.end(), load.latencies_ns.begin(),
+                                 load.latencies_ns.end());
+                bytes += load.bytes;
+                errors += load.errors;
+            }
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&latencies](double p) {
+                return latencies.empty()
+                           ? 0.0
+                           : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+            };
+            printf("%-28s %-8s %10.0f req/s  p50 %10s  p99 %10s  %8.0f bytes/req  %llu errors\n",
+                   path, gzip ? "gzip" : "identity", latencies.size() / elapsed,
+                   formatTime(percentile(0.5)).c_str(), formatTime(percentile(0.99)).c_str(),
+                   latencies.empty() ? 0.0 : static_cast<double>(bytes) / latencies.size(),
+                   static_cast<unsigned long long>(errors));
+            ok = ok && errors == 0 && !latencies.empty();
+        }
+    }
+    return ok;
+}
+
+#ifdef MACOS_COMPATIBILITY_BENCH_EXTENSION
+// An unchanged feed: the same snapshot and host facts for every query
+struct BenchSource {
+    static std::shared_ptr<const SofaSnapshot> macos;
+    static std::shared_ptr<const HostFacts> facts;
+
+    static std::shared_ptr<const SofaSnapshot> snapshot(FeedId, const std::string&,
+                                                        std::string&) {
+        return macos;
+    }
+
+    static uint64_t downloadBytes(FeedId) { return 0; }
+    static uint64_t downloadBytesTotal(FeedId) { return 0; }
+    static std::shared_ptr<const HostFacts> hostFacts() { return facts; }
+    static BundleVersions bundleVersions(const std::vector<std::string>&) { return {}; }
+};
+
+std::shared_ptr<const SofaSnapshot> BenchSource::macos;
+std::shared_ptr<const HostFacts> BenchSource::facts;
+
+// The extension's work per query besides the lookup itself
+class ExtensionBenchmarks {
+ public:
+    ExtensionBenchmarks()
+        : feed_(FeedSpec{"bench", "bench_data_feed", nullptr, false}, writer_, [] {}) {}
+
+    void add(std::vector<Benchmark>& benchmarks, std::shared_ptr<const SofaSnapshot> snapshot,
+             const std::string& model) {
+        static constexpr size_t kOps = 1000;
+        static constexpr size_t kEmitted = 100;
+        static constexpr size_t kQueries = 100;
+        // Repeated queries of macos_compatibility on an unchanged feed,
+        // answered from the memoized row after the first
+        BenchSource::macos = std::move(snapshot);
+        BenchSource::facts = std::make_shared<HostFacts>(HostFacts{"14.5", "14", model, {}});
+        table_.generate(context_);
+        benchmarks.push_back({"query_memo", kQueries, nullptr, [this] {
+                                  for (size_t i = 0; i < kQueries; i++) {
+                                      auto rows = table_.generate(context_);
+                                  }
+                              }});
+        // Every query bumps its feed's query counter
+        benchmarks.push_back({"query_count", kOps, nullptr, [this] {
+                                  for (size_t i = 0; i < kOps; i++) {
+                                      feed_.count(SofaFeed::kQueries);
+                                  }
+                              }});
+        // A query failing like the one before it: the message was logged
+        // within the interval and is only counted
+        SOFA_LOG_LIMITED(INFO, suppressed_key_, "Rate limited log benchmark");
+        benchmarks.push_back({"log_suppressed", kOps, nullptr, [this] {
+                                  for (size_t i = 0; i < kOps; i++) {
+                                      SOFA_LOG_LIMITED(INFO, suppressed_key_,
+                                                       "Rate limited log benchmark");
+                                  }
+                              }});
+        // A message that is logged, under a key not seen before
+        benchmarks.push_back({"log_emitted", kEmitted,
+                              [this] {
+                                  keys_.clear();
+                                  for (size_t i = 0; i < kEmitted; i++) {
+                                      keys_.push_back("bench emitted " +
+                                                      std::to_string(next_key_++));
+                                  }
+                              },
+                              [this] {
+                                  for (const auto& key : keys_) {
+                                      SOFA_LOG_LIMITED(INFO, key,
+                                                       "Rate limited log benchmark " << key);
+                                  }
+                              }});
+        // The periodic summary line, with counters that moved since the last
+        benchmarks.push_back({"log_summary", 1, [this] { feed_.count(SofaFeed::kQueries); },
+                              [this] { feed_.logSummary(logInterval()); }});
+    }
+
+ private:
+    BasicMacOSCompatibilityTable<BenchSource> table_;
+    QueryContext context_;
+    CacheWriter writer_;
+    SofaFeed feed_;
+    std::string suppressed_key_ = "bench request";
+    std::vector<std::string> keys_;
+    size_t next_key_ = 0;
+};
+#endif
+
+int usage() {
+    fprintf(stderr,
+            "usage: sofa_core_bench [--iterations N] [--url URL] [--save FILE]\n"
+            "                       [--compare FILE] [--threshold PCT]\n"
+            "                       [--mirror SOFA_MIRROR [--clients N] [--duration SECONDS]] FEED\n");
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t iterations = kDefaultIterations;
+    double threshold = kDefaultThreshold;
+    std::string url;
+    std::string mirror_path;
+    unsigned clients = kDefaultClients;
+    double duration = kDefaultDuration;
+    std::string save_path;
+    std::string compare_path;
+    std::string feed_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--iterations" && has_value) {
+            iterations = std::max(1L, std::atol(argv[++i]));
+        } else if (arg == "--url" && has_value) {
+            url = argv[++i];
+        } else if (arg == "--mirror" && has_value) {
+            mirror_path = argv[++i];
+        } else if (arg == "--clients" && has_value) {
+            clients = static_cast<unsigned>(std::max(1L, std::atol(argv[++i])));
+        } else if (arg == "--duration" && has_value) {
+            duration = std::max(0.1, std::atof(argv[++i]));
+        } else if (arg == "--save" && has_value) {
+            save_path = argv[++i];
+        } else if (arg == "--compare" && has_value) {
+            compare_path = argv[++i];
+        } else if (arg == "--threshold" && has_value) {
+            threshold = std::atof(argv[++i]);
+        } else if (feed_path.empty() && arg[0] != '-') {
+            feed_path = arg;
+        } else {
+            return usage();
+        }
+    }
+    if (feed_path.empty()) {
+        return usage();
+    }
+
+    std::string text;
+    if (!readFile(feed_path, text)) {
+        fprintf(stderr, "Cannot read %s\n", feed_path.c_str());
+        return 1;
+    }
+    std::string error;
+    std::string copy = text;
+    auto snapshot = SofaSnapshot::parse(copy, error);
+    if (snapshot == nullptr) {
+        fprintf(stderr, "Cannot parse %s: %s\n", feed_path.c_str(), error.c_str());
+        return 1;
+    }
+    std::string index = snapshot->serialize();
+    auto models = snapshot->modelIdentifiers();
+    printf("%s: %zu bytes, %zu models, index %zu bytes, arena %zu bytes in %zu blocks, "
+           "%zu iterations\n",
+           feed_path.c_str(), text.size(), models.size(), index.size(),
+           snapshot->arena().reserved(), snapshot->arena().blocks(), iterations);
+
+    std::vector<Benchmark> benchmarks;
+    // The nlohmann DOM the SAX builder replaced, for reference
+    benchmarks.push_back({"dom_parse", 1, nullptr, [&] {
+                              auto document = json::parse(text, nullptr, false);
+                          }});
+    benchmarks.push_back({"parse", 1, [&] { copy = text; }, [&] {
+                              auto parsed = SofaSnapshot::parse(copy, error);
+                          }});
+    benchmarks.push_back({"read_stream", 1, nullptr, [&] {
+                              std::ifstream in(feed_path, std::ios::binary);
+                              auto parsed = SofaSnapshot::read(in, error);
+                          }});
+    benchmarks.push_back({"index_serialize", 1, nullptr, [&] {
+                              std::string built = snapshot->serialize();
+                          }});
+    benchmarks.push_back({"index_load", 1, nullptr, [&] {
+                              auto loaded = SofaSnapshot::deserialize(index, error);
+                          }});
+    if (!models.empty()) {
+        // One lookup is what a table row needs: the model's releases and
+        // the CVEs fixed in each since an old version
+        benchmarks.push_back({"lookup", models.size(), nullptr, [&] {
+                                  uint32_t cves = 0;
+                                  for (auto model : models) {
+                                      for (const auto* release : snapshot->supportedReleases(model)) {
+                                          cves += snapshot->cvesSince(*release, 0).cves;
+                                      }
+                                  }
+                                  keep(cves);
+                              }});
+    }
+
+#ifdef MACOS_COMPATIBILITY_BENCH_EXTENSION
+    ExtensionBenchmarks extension;
+    extension.add(benchmarks, snapshot,
+                  models.empty() ? "Macmini9,1" : std::string(models.front()));
+#endif
+
+    CURL* curl = nullptr;
+    std::string body;
+    if (!url.empty()) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        curl = curl_easy_init();
+        if (!fetch(curl, url, body)) {
+            fprintf(stderr, "Cannot fetch %s\n", url.c_str());
+            return 1;
+        }
+        benchmarks.push_back({"fetch", 1, nullptr, [&] {
+                                  if (fetch(curl, url, body)) {
+                                      auto fetched = SofaSnapshot::parse(body, error);
+                                  }
+                              }});
+    }
+
+    HardwareCounters hardware;
+    if (!hardware.error().empty()) {
+        printf("Hardware counters unavailable (%s)\n", hardware.error().c_str());
+    }
+    std::vector<Result> results;
+    for (const auto& benchmark : benchmarks) {
+        results.push_back(run(benchmark, iterations, hardware));
+        print(results.back());
+    }
+    if (curl != nullptr) {
+        curl_easy_cleanup(curl);
+    }
+    if (!mirror_path.empty()) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (!benchMirror(mirror_path, feed_path, text, clients, duration)) {
+            return 1;
+        }
+    }
+
+    if (!save_path.empty()) {
+        std::ofstream out(save_path);
+        out << toJson(results).dump(2) << "\n";
+        if (!out) {
+            fprintf(stderr, "Cannot write %s\n", save_path.c_str());
+            return 1;
+        }
+    }
+    if (!compare_path.empty()) {
+        std::string stored;
+        json baseline;
+        if (readFile(compare_path, stored)) {
+            baseline = json::parse(stored, nullptr, false);
+        }
+        if (!baseline.is_object() || !baseline.contains("benchmarks")) {
+            fprintf(stderr, "Cannot read baseline %s\n", compare_path.c_str());
+            return 1;
+        }
+        printf("\nAgainst %s (threshold %.1f%%):\n", compare_path.c_str(), threshold);
+        if (compare(results, baseline, threshold) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
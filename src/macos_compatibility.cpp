@@ -1,36 +1,2574 @@
+#include <osquery/config/config.h>
+#include <osquery/core/flags.h>
 #include <osquery/core/system.h>
 #include <osquery/sdk/sdk.h>
 #include <osquery/sql/dynamic_table_row.h>
 #include <osquery/tables/system/darwin/smbios_utils.h>
 #include <osquery/logger/logger.h>
+#include <osquery/utils/base64.h>
+
+#include "sofa_core.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+#include <sys/event.h>
+#else
+#include <malloc.h>
+#include <sys/inotify.h>
+#endif
 
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
-#include <string>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace osquery {
+
+FLAG(uint64,
+     macos_compatibility_max_feed_bytes,
+     32 * 1024 * 1024,
+     "Abort SOFA feed downloads larger than this many bytes (0 for no limit)");
+
+FLAG(bool,
+     macos_compatibility_low_memory,
+     false,
+     "Refresh the SOFA feed with a bounded footprint for watchdog-limited hosts. "
+     "simdjson builds still hold the whole body to parse it; they only return freed heap");
+
+FLAG(uint64,
+     macos_compatibility_refresh_rss_limit_mb,
+     0,
+     "Skip network refreshes and use the cache while RSS is above this (0 for no limit)");
+
+FLAG(bool,
+     macos_compatibility_watch_cache,
+     false,
+     "Reload the SOFA snapshot when another process replaces the shared cache file");
+
+FLAG(string,
+     macos_compatibility_cache_dir,
+     "/private/var/tmp/sofa",
+     "Directory of the SOFA feed cache, shared with other SOFA consumers");
+
+FLAG(string,
+     macos_compatibility_feed_source,
+     "network",
+     "Where the SOFA feed comes from: network, or config to use the osquery config only");
+
+FLAG(string,
+     macos_compatibility_feed_urls,
+     "",
+     "Comma-separated SOFA feed URLs, tried fastest first with hedged requests "
+     "(default: sofafeed.macadmins.io)");
+
+FLAG(uint64,
+     macos_compatibility_hedge_delay_ms,
+     0,
+     "Ask the next feed URL after this many ms without an answer (0: observed p95)");
+
+FLAG(string,
+     macos_compatibility_ios_feed_urls,
+     "",
+     "Comma-separated SOFA iOS/iPadOS feed URLs (default: sofafeed.macadmins.io)");
+
+FLAG(string,
+     macos_compatibility_feeds,
+     "",
+     "SOFA feeds (macos, ios) to also keep fresh before their tables are queried; "
+     "a feed's first query always starts it");
+
+FLAG(uint64,
+     macos_compatibility_refresh_interval,
+     1800,
+     "Seconds between background refreshes of each SOFA feed");
+
+FLAG(string,
+     macos_compatibility_mirror_url,
+     "",
+     "Base URL of a sofa_mirror; its compact index is preferred over the upstream feed");
+
+FLAG(uint64,
+     macos_compatibility_log_interval,
+     600,
+     "Seconds between SOFA feed log summaries; repeated warnings are logged once per interval "
+     "(at least 10)");
+
+FLAG(string,
+     macos_compatibility_record_dir,
+     "",
+     "Record every SOFA HTTP exchange as a fixture in this directory, for sofa_mirror --replay");
+
+struct ResourceUsage {
+    uint64_t rss_bytes = 0;
+    uint64_t peak_rss_bytes = 0;
+    uint64_t cpu_time_ms = 0;
+};
+
+// Current and peak resident memory plus CPU time of this process
+static ResourceUsage getResourceUsage() {
+    ResourceUsage usage;
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+        usage.peak_rss_bytes = static_cast<uint64_t>(ru.ru_maxrss);
+#else
+        usage.peak_rss_bytes = static_cast<uint64_t>(ru.ru_maxrss) * 1024;
+#endif
+        usage.cpu_time_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+                            (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+    }
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                  reinterpret_cast<task_info_t>(&info), &count) == KERN_SUCCESS) {
+        usage.rss_bytes = info.resident_size;
+    }
+#else
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0;
+    uint64_t resident = 0;
+    if (statm >> size >> resident) {
+        usage.rss_bytes = resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return usage;
+}
+
+// Hand heap pages freed after an index build back to the OS
+static void releaseFreedMemory() {
+#ifdef __APPLE__
+    malloc_zone_pressure_relief(nullptr, 0);
+#else
+    malloc_trim(0);
+#endif
+}
+
+// --macos_compatibility_log_interval with its floor, shared by the rate
+// limited warnings and the periodic feed summaries
+static std::chrono::seconds logInterval() {
+    static constexpr uint64_t kMinLogInterval = 10;
+    return std::chrono::seconds(
+        std::max<uint64_t>(FLAGS_macos_compatibility_log_interval, kMinLogInterval));
+}
+
+// Drops repeats of a log message. The first message for a key is logged,
+// later ones at most once per --macos_compatibility_log_interval, and the
+// next one logged carries the count of those dropped in between.
+class LogLimiter {
+ public:
+    static LogLimiter& instance() {
+        static LogLimiter limiter;
+        return limiter;
+    }
+
+    // Whether a message for key may be logged now; suppressed is set to the
+    // number of messages dropped since the last one was
+    bool allow(const std::string& key, uint64_t& suppressed) {
+        auto now = std::chrono::steady_clock::now();
+        auto window = logInterval();
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& entry = entries_[key];
+        if (entry.logged && now - entry.last < window) {
+            entry.suppressed++;
+            return false;
+        }
+        entry.logged = true;
+        entry.last = now;
+        suppressed = entry.suppressed;
+        entry.suppressed = 0;
+        return true;
+    }
+
+    static std::string note(uint64_t suppressed) {
+        if (suppressed == 0) {
+            return "";
+        }
+        return " (" + std::to_string(suppressed) + " similar messages suppressed)";
+    }
+
+ private:
+    struct Entry {
+        bool logged = false;
+        std::chrono::steady_clock::time_point last;
+        uint64_t suppressed = 0;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+};
+
+// LOG(severity) << message, rate limited per key by LogLimiter. The message
+// is only formatted when it is actually logged.
+#define SOFA_LOG_LIMITED(severity, key, message)                                  \
+    do {                                                                          \
+        uint64_t sofa_suppressed = 0;                                             \
+        if (LogLimiter::instance().allow((key), sofa_suppressed)) {               \
+            LOG(severity) << message << LogLimiter::note(sofa_suppressed);        \
+        }                                                                         \
+    } while (false)
+
+// Streambuf connecting the curl write callback to the parser thread. Chunks
+// are handed over as they arrive and released once the parser consumed them.
+class ChunkPipe : public std::streambuf {
+ public:
+    // Block the writer while more than this many bytes are queued (0 for no limit)
+    void setLimit(size_t max_queued) { max_queued_ = max_queued; }
+
+    void push(const char* data, size_t size) {
+        // An empty chunk would read as a NUL in underflow()
+        if (size == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        drained_.wait(lock, [this] {
+            return closed_ || max_queued_ == 0 || queued_ < max_queued_;
+        });
+        if (closed_) {
+            return;
+        }
+        chunks_.emplace_back(data, size);
+        queued_ += size;
+        ready_.notify_one();
+    }
+
+    // No more input; the reader sees EOF once the queued chunks are drained
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        ready_.notify_one();
+    }
+
+    // The reader is done; drop queued and future chunks
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        chunks_.clear();
+        queued_ = 0;
+        ready_.notify_one();
+        drained_.notify_one();
+    }
+
+ protected:
+    int_type underflow() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this] { return !chunks_.empty() || closed_; });
+        if (chunks_.empty()) {
+            return traits_type::eof();
+        }
+        current_ = std::move(chunks_.front());
+        chunks_.pop_front();
+        queued_ -= current_.size();
+        drained_.notify_one();
+        setg(&current_[0], &current_[0], &current_[0] + current_.size());
+        return traits_type::to_int_type(current_[0]);
+    }
+
+ private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable drained_;
+    std::deque<std::string> chunks_;
+    std::string current_;
+    size_t queued_ = 0;
+    size_t max_queued_ = 0;
+    bool closed_ = false;
+};
+
+// Identity of a file as reported by stat(). Replacing or rewriting the file
+// changes at least one field, so comparing identities tells whether a file
+// needs to be read again.
+struct FileIdentity {
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = 0;
+    int64_t mtime_ns = 0;
+
+    // The identity of path, or an empty identity if it does not exist
+    static FileIdentity of(const std::string& path) {
+        FileIdentity identity;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return identity;
+        }
+        identity.device = st.st_dev;
+        identity.inode = st.st_ino;
+        identity.size = st.st_size;
+#ifdef __APPLE__
+        identity.mtime_ns = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+        identity.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+        return identity;
+    }
+
+    bool exists() const { return inode != 0; }
+
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device && inode == other.inode && size == other.size &&
+               mtime_ns == other.mtime_ns;
+    }
+    bool operator!=(const FileIdentity& other) const { return !(*this == other); }
+};
+
+// Create a uniquely named temporary sibling of path with mkstemp(), so
+// writers in other processes sharing the cache directory never collide.
+// Returns its name, or "" on failure.
+static std::string createTempFile(const std::string& path) {
+    std::string name = path + ".tmp.XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        return "";
+    }
+    // Readable by the other SOFA consumers once renamed into place
+    fchmod(fd, 0644);
+    close(fd);
+    return name;
+}
+
+// Persists cache files on a background thread so queries never wait on the
+// disk. Each file is written to a temporary sibling and renamed over its
+// target, and the files of a batch land in order. A batch submitted while an
+// older one for the same key is still queued replaces it.
+class CacheWriter {
+ public:
+    // Target path and content
+    using File = std::pair<std::string, std::string>;
+    // Runs on the writer thread once every file of a batch is in place
+    using Callback = std::function<void()>;
+
+    CacheWriter() : thread_([this] { run(); }) {}
+    CacheWriter(const CacheWriter&) = delete;
+    CacheWriter& operator=(const CacheWriter&) = delete;
+
+    ~CacheWriter() { stop(); }
+
+    // Write the queued batches, running their callbacks, and end the thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void submit(const std::string& key, std::vector<File> files, Callback done = nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_[key] = {std::move(files), std::move(done)};
+        }
+        wake_.notify_one();
+    }
+
+    // Like submit(), but leaves a batch already queued for key in place,
+    // as that one is newer
+    void submitUnlessPending(const std::string& key, std::vector<File> files) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.count(key) != 0) {
+                return;
+            }
+            pending_[key] = {std::move(files), nullptr};
+        }
+        wake_.notify_one();
+    }
+
+ private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                return;
+            }
+            auto batch = std::move(pending_.begin()->second);
+            pending_.erase(pending_.begin());
+            lock.unlock();
+            bool written = true;
+            for (const auto& [path, content] : batch.files) {
+                if (!writeAtomically(path, content)) {
+                    SOFA_LOG_LIMITED(WARNING, "cache write " + path,
+                                     "Failed to update SOFA cache file: " << path);
+                    written = false;
+                    break;
+                }
+            }
+            if (written && batch.done) {
+                batch.done();
+            }
+            lock.lock();
+        }
+    }
+
+    static bool writeAtomically(const std::string& path, const std::string& content) {
+        std::string temp_path = createTempFile(path);
+        if (temp_path.empty()) {
+            return false;
+        }
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            unlink(temp_path.c_str());
+            return false;
+        }
+        file.write(content.data(), content.size());
+        file.close();
+        if (file.fail() || rename(temp_path.c_str(), path.c_str()) != 0) {
+            unlink(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    struct Batch {
+        std::vector<File> files;
+        Callback done;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::map<std::string, Batch> pending_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// Watches the cache directory and runs a callback when one of the cache
+// files may have been replaced, e.g. renamed into place by another SOFA
+// consumer.
+// Events are debounced so a feed, hash and etag written together cause one
+// callback. Backed by inotify on Linux and kqueue on macOS; macOS reports
+// directory writes without names, so every change there runs the callback
+// and the callback's stat() check sorts out the rest.
+class CacheDirWatcher {
+ public:
+    using Callback = std::function<void()>;
+
+    CacheDirWatcher(std::string dir, std::set<std::string> file_names, Callback on_change)
+        : dir_(std::move(dir)),
+          file_names_(std::move(file_names)),
+          on_change_(std::move(on_change)) {}
+    CacheDirWatcher(const CacheDirWatcher&) = delete;
+    CacheDirWatcher& operator=(const CacheDirWatcher&) = delete;
+
+    ~CacheDirWatcher() {
+        if (thread_.joinable()) {
+            char stop = 0;
+            (void)write(stop_pipe_[1], &stop, 1);
+            thread_.join();
+        }
+        for (int fd : {stop_pipe_[0], stop_pipe_[1], watch_fd_, dir_fd_}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    bool start() {
+        if (pipe(stop_pipe_) != 0) {
+            return false;
+        }
+#ifdef __APPLE__
+        dir_fd_ = open(dir_.c_str(), O_EVTONLY);
+        watch_fd_ = kqueue();
+        if (dir_fd_ < 0 || watch_fd_ < 0) {
+            return false;
+        }
+        struct kevent changes[2];
+        EV_SET(&changes[0], dir_fd_, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, nullptr);
+        EV_SET(&changes[1], stop_pipe_[0], EVFILT_READ, EV_ADD, 0, 0, nullptr);
+        if (kevent(watch_fd_, changes, 2, nullptr, 0, nullptr) != 0) {
+            return false;
+        }
+#else
+        watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd_ < 0 ||
+            inotify_add_watch(watch_fd_, dir_.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+            return false;
+        }
+#endif
+        thread_ = std::thread([this] { run(); });
+        return true;
+    }
+
+ private:
+    enum class Wait { kChanged, kTimeout, kStopped };
+
+    static constexpr int kSettleMs = 200;
+
+    void run() {
+        while (true) {
+            Wait result = wait(-1);
+            if (result == Wait::kStopped) {
+                return;
+            }
+            if (result != Wait::kChanged) {
+                continue;
+            }
+            // Let a burst of related writes finish first
+            while ((result = wait(kSettleMs)) == Wait::kChanged) {
+            }
+            if (result == Wait::kStopped) {
+                return;
+            }
+            on_change_();
+        }
+    }
+
+#ifdef __APPLE__
+    Wait wait(int timeout_ms) {
+        struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        struct kevent event;
+        int n = kevent(watch_fd_, nullptr, 0, &event, 1, timeout_ms < 0 ? nullptr : &timeout);
+        if (n < 0) {
+            return errno == EINTR ? Wait::kTimeout : Wait::kStopped;
+        }
+        if (n == 0) {
+            return Wait::kTimeout;
+        }
+        return static_cast<int>(event.ident) == stop_pipe_[0] ? Wait::kStopped : Wait::kChanged;
+    }
+#else
+    Wait wait(int timeout_ms) {
+        struct pollfd fds[2] = {{watch_fd_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+        int n = poll(fds, 2, timeout_ms);
+        if (n < 0) {
+            return errno == EINTR ? Wait::kTimeout : Wait::kStopped;
+        }
+        if (fds[1].revents != 0) {
+            return Wait::kStopped;
+        }
+        if (n == 0) {
+            return Wait::kTimeout;
+        }
+
+        bool changed = false;
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(watch_fd_, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length;) {
+                auto* event = reinterpret_cast<struct inotify_event*>(p);
+                if (event->len > 0 && file_names_.count(event->name) > 0) {
+                    changed = true;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return changed ? Wait::kChanged : Wait::kTimeout;
+    }
+#endif
+
+    std::string dir_;
+    std::set<std::string> file_names_;
+    Callback on_change_;
+    int stop_pipe_[2] = {-1, -1};
+    int watch_fd_ = -1;
+    int dir_fd_ = -1;
+    std::thread thread_;
+};
+
+// One feed transfer. A 200 body is kept for the background cache writer and,
+// with the nlohmann backend, fed to a SAX parser thread as it arrives, so the
+// index is ready shortly after the last byte rather than after buffering and
+// parsing one after another. In low-memory mode nothing is kept: the body is
+// streamed into a temporary cache file instead. A compact index from a mirror
+// is small and decodes in one pass, so it is always buffered and decoded at
+// the end.
+class FeedDownload {
+ public:
+    // In low-memory mode the nlohmann backend keeps no copy of the body and
+    // the parser pipe holds at most kLowMemoryPipeBytes at a time. simdjson
+    // parses one padded buffer, so there the body is always kept.
+    FeedDownload(CURL* curl,
+                 std::string cache_path,
+                 size_t max_bytes,
+                 bool low_memory,
+                 bool compact = false)
+        : curl_(curl),
+          cache_path_(std::move(cache_path)),
+          max_bytes_(max_bytes),
+          compact_(compact) {
+#ifndef MACOS_COMPATIBILITY_SIMDJSON
+        keep_body_ = compact || !low_memory;
+        if (low_memory) {
+            pipe_.setLimit(kLowMemoryPipeBytes);
+        }
+#endif
+    }
+    FeedDownload(const FeedDownload&) = delete;
+    FeedDownload& operator=(const FeedDownload&) = delete;
+
+    ~FeedDownload() {
+        stopParser();
+        if (file_.is_open()) {
+            file_.close();
+            unlink(temp_path_.c_str());
+        }
+    }
+
+    // Called from WriteCallback for every chunk of the response body.
+    // Returns false to abort a transfer that exceeds the size cap.
+    bool append(const char* data, size_t size) {
+        if (!started_) {
+            start();
+        }
+        received_ += size;
+        if (oversized_ || (max_bytes_ > 0 && received_ > max_bytes_)) {
+            oversized_ = true;
+            stopParser();
+            return false;
+        }
+        if (record_) {
+            record_->append(data, size);
+        }
+        if (!streaming_) {
+            return true;
+        }
+        hash_.update(data, size);
+        if (keep_body_) {
+            body_.append(data, size);
+        } else if (file_.is_open()) {
+            file_.write(data, size);
+        }
+#ifndef MACOS_COMPATIBILITY_SIMDJSON
+        if (!compact_) {
+            pipe_.push(data, size);
+        }
+#endif
+        return true;
+    }
+
+    // True when the body was, or was announced to be, larger than the cap
+    bool oversized() const { return oversized_; }
+
+    // Also copy every body byte, whatever the status, into body
+    void recordTo(std::string* body) { record_ = body; }
+
+    // Complete a successful 200 transfer: wait for the index, then move a
+    // streamed cache file into place. Returns nullptr if the body does not parse.
+    std::shared_ptr<const SofaSnapshot> finish(std::string& error) {
+        if (!started_) {
+            start();
+        }
+        if (!streaming_) {
+            return nullptr;
+        }
+        if (compact_) {
+            return SofaSnapshot::deserialize(body_, error);
+        }
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+        auto snapshot = SofaSnapshot::parse(body_, error);
+        if (!snapshot) {
+            return nullptr;
+        }
+#else
+        pipe_.close();
+        parser_.join();
+        if (!snapshot_) {
+            error = parse_error_;
+            return nullptr;
+        }
+        auto snapshot = snapshot_;
+#endif
+        if (file_.is_open()) {
+            file_.close();
+            if (file_.fail() || rename(temp_path_.c_str(), cache_path_.c_str()) != 0) {
+                SOFA_LOG_LIMITED(WARNING, "cache write " + cache_path_,
+                                 "Failed to update SOFA cache file: " << cache_path_);
+                unlink(temp_path_.c_str());
+            } else {
+                persisted_ = true;
+            }
+        }
+        return snapshot;
+    }
+
+    // True once finish() has moved a streamed body into the cache file
+    bool persisted() const { return persisted_; }
+
+    // The retained body, empty when it was streamed to disk instead
+    std::string takeBody() { return std::move(body_); }
+
+    // Integrity hash of the body
+    std::string hash() const { return hash_.hex(); }
+
+ private:
+    // Runs once the headers are in; only 200 responses are streamed
+    void start() {
+        started_ = true;
+        long http_code = 0;
+        curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code != 200) {
+            return;
+        }
+
+        curl_off_t length = -1;
+        if (curl_easy_getinfo(curl_, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK &&
+            length > 0) {
+            if (max_bytes_ > 0 && static_cast<size_t>(length) > max_bytes_) {
+                oversized_ = true;
+                return;
+            }
+            if (keep_body_) {
+                body_.reserve(static_cast<size_t>(length));
+            }
+        }
+        streaming_ = true;
+
+        if (!keep_body_) {
+            temp_path_ = createTempFile(cache_path_);
+            if (!temp_path_.empty()) {
+                file_.open(temp_path_, std::ios::binary | std::ios::trunc);
+            }
+            if (!file_.is_open()) {
+                if (!temp_path_.empty()) {
+                    unlink(temp_path_.c_str());
+                }
+                SOFA_LOG_LIMITED(WARNING, "cache open " + cache_path_,
+                                 "Failed to open SOFA cache file: " << temp_path_);
+            }
+        }
+
+#ifndef MACOS_COMPATIBILITY_SIMDJSON
+        if (compact_) {
+            return;
+        }
+        parser_ = std::thread([this] {
+            std::istream in(&pipe_);
+            snapshot_ = SofaSnapshot::read(in, parse_error_);
+            pipe_.cancel();
+        });
+#endif
+    }
+
+    void stopParser() {
+#ifndef MACOS_COMPATIBILITY_SIMDJSON
+        if (parser_.joinable()) {
+            pipe_.cancel();
+            parser_.join();
+        }
+#endif
+    }
+
+    static constexpr size_t kLowMemoryPipeBytes = 256 * 1024;
+
+    CURL* curl_;
+    std::string cache_path_;
+    // Unique per transfer, so hedged transfers never share it
+    std::string temp_path_;
+    size_t max_bytes_;
+    bool compact_;
+    bool keep_body_ = true;
+    size_t received_ = 0;
+    bool started_ = false;
+    bool streaming_ = false;
+    bool oversized_ = false;
+    bool persisted_ = false;
+    FeedHash hash_;
+    std::string body_;
+    std::string* record_ = nullptr;
+    std::ofstream file_;
+#ifndef MACOS_COMPATIBILITY_SIMDJSON
+    ChunkPipe pipe_;
+    std::thread parser_;
+    std::shared_ptr<const SofaSnapshot> snapshot_;
+    std::string parse_error_;
+#endif
+};
+
+// Callback function for curl
+static size_t WriteCallback(void* contents, size_t size, size_t nmemb, FeedDownload* userp) {
+    if (!userp->append(static_cast<const char*>(contents), size * nmemb)) {
+        return 0;
+    }
+    return size * nmemb;
+}
+
+// One request for a feed: the easy handle, its headers and the download
+// its body streams into
+class FeedTransfer {
+ public:
+    // A server that accepts the connection and then stalls must not hold
+    // the refresh forever
+    static constexpr long kConnectTimeoutSeconds = 10;
+    static constexpr long kLowSpeedTimeSeconds = 30;
+    static constexpr long kTimeoutSeconds = 300;
+
+    FeedTransfer(const std::string& url,
+                 const std::string& etag,
+                 const std::string& user_agent,
+                 const std::string& cache_path,
+                 bool compact)
+        : url_(url),
+          handle_(curl_easy_init(), curl_easy_cleanup),
+          download_(handle_.get(), cache_path, FLAGS_macos_compatibility_max_feed_bytes,
+                    FLAGS_macos_compatibility_low_memory, compact),
+          started_(std::chrono::steady_clock::now()) {
+        CURL* curl = handle_.get();
+        if (!curl) {
+            return;
+        }
+
+        if (!FLAGS_macos_compatibility_record_dir.empty()) {
+            fixture_ = std::make_unique<HttpFixture>();
+            fixture_->url = url;
+            fixture_->request_etag = etag;
+            download_.recordTo(&fixture_->body);
+        }
+
+        // If we have a cached etag, use it
+        if (!etag.empty()) {
+            std::string header = "If-None-Match: " + etag;
+            headers_ = curl_slist_append(headers_, header.c_str());
+        }
+
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &download_);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers_);
+        // Reject bodies whose Content-Length is over the cap before they start
+        curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE,
+                         static_cast<curl_off_t>(FLAGS_macos_compatibility_max_feed_bytes));
+        // Mirrors serve their bodies gzip-compressed when asked to
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, kConnectTimeoutSeconds);
+        // Abort when less than a byte per second arrives for this long
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, kLowSpeedTimeSeconds);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, kTimeoutSeconds);
+    }
+    FeedTransfer(const FeedTransfer&) = delete;
+    FeedTransfer& operator=(const FeedTransfer&) = delete;
+
+    ~FeedTransfer() { curl_slist_free_all(headers_); }
+
+    CURL* handle() const { return handle_.get(); }
+    const std::string& url() const { return url_; }
+    FeedDownload& download() { return download_; }
+
+    // Record the transfer result. Returns true for a usable response: a 304,
+    // or a 200 whose body indexed.
+    bool complete(CURLcode result) {
+        result_ = result;
+        curl_easy_getinfo(handle(), CURLINFO_RESPONSE_CODE, &http_code_);
+        if (fixture_ && result_ == CURLE_OK) {
+            record();
+        }
+        if (result_ != CURLE_OK || download_.oversized()) {
+            return false;
+        }
+        if (http_code_ == 304) {
+            return true;
+        }
+        if (http_code_ == 200) {
+            snapshot_ = download_.finish(parse_error_);
+            return snapshot_ != nullptr;
+        }
+        return false;
+    }
+
+    CURLcode result() const { return result_; }
+    long httpCode() const { return http_code_; }
+
+    // Index of a 200 body, or nullptr with parseError() describing why not
+    std::shared_ptr<const SofaSnapshot> snapshot() const { return snapshot_; }
+    const std::string& parseError() const { return parse_error_; }
+
+    std::string etag() const {
+        struct curl_header* header = nullptr;
+        if (curl_easy_header(handle(), "ETag", 0, CURLH_HEADER, -1, &header) == CURLHE_OK) {
+            return header->value;
+        }
+        return "";
+    }
+
+    // Bytes received so far, headers included
+    uint64_t wireBytes() const {
+        curl_off_t body_bytes = 0;
+        long header_bytes = 0;
+        curl_easy_getinfo(handle(), CURLINFO_SIZE_DOWNLOAD_T, &body_bytes);
+        curl_easy_getinfo(handle(), CURLINFO_HEADER_SIZE, &header_bytes);
+        return static_cast<uint64_t>(body_bytes) + static_cast<uint64_t>(header_bytes);
+    }
+
+    double elapsedMs() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                         started_)
+            .count();
+    }
+
+ private:
+    // Write the exchange to --macos_compatibility_record_dir
+    void record() {
+        static std::atomic<unsigned> next_fixture{0};
+        fixture_->status = http_code_;
+        fixture_->elapsed_ms = elapsedMs();
+        fixture_->etag = etag();
+        char* content_type = nullptr;
+        if (curl_easy_getinfo(handle(), CURLINFO_CONTENT_TYPE, &content_type) == CURLE_OK &&
+            content_type != nullptr) {
+            fixture_->content_type = content_type;
+        }
+
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        std::string path = FLAGS_macos_compatibility_record_dir + "/" +
+                           std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                              now).count()) +
+                           "-" + std::to_string(next_fixture++) + ".fixture";
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        std::string encoded = fixture_->encode();
+        file.write(encoded.data(), static_cast<std::streamsize>(encoded.size()));
+        if (!file) {
+            SOFA_LOG_LIMITED(WARNING, "record", "Failed to write SOFA fixture: " << path);
+        }
+    }
+
+    std::string url_;
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> handle_;
+    // Set in record mode; declared before the download that appends to it
+    std::unique_ptr<HttpFixture> fixture_;
+    FeedDownload download_;
+    struct curl_slist* headers_ = nullptr;
+    std::chrono::steady_clock::time_point started_;
+    CURLcode result_ = CURLE_OK;
+    long http_code_ = 0;
+    std::shared_ptr<const SofaSnapshot> snapshot_;
+    std::string parse_error_;
+};
+
+// Response times of recent requests per feed URL. Mirrors are tried in
+// order of their median, and the hedge delay follows the p95 of the one
+// tried first.
+class LatencyStats {
+ public:
+    void record(const std::string& url, double ms) {
+        auto& samples = samples_[url];
+        samples.push_back(ms);
+        if (samples.size() > kMaxSamples) {
+            samples.pop_front();
+        }
+    }
+
+    // A failed request counts as a very slow one
+    void recordFailure(const std::string& url) { record(url, kFailurePenaltyMs); }
+
+    // A request cancelled after waiting ms only shows that the URL is slower
+    // than that, so the wait may raise its estimate but never lower it. An
+    // unmeasured URL stays unmeasured.
+    void recordCensored(const std::string& url, double ms) {
+        auto it = samples_.find(url);
+        if (it != samples_.end() && !it->second.empty() && ms > percentile(url, 0.5, ms)) {
+            record(url, ms);
+        }
+    }
+
+    // Measured URLs by median latency, then unmeasured ones in their given order
+    std::vector<std::string> order(std::vector<std::string> urls) const {
+        std::stable_sort(urls.begin(), urls.end(), [this](const auto& a, const auto& b) {
+            return percentile(a, 0.5, kUnmeasured) < percentile(b, 0.5, kUnmeasured);
+        });
+        return urls;
+    }
+
+    double percentile(const std::string& url, double p, double fallback) const {
+        auto it = samples_.find(url);
+        if (it == samples_.end() || it->second.empty()) {
+            return fallback;
+        }
+        std::vector<double> sorted(it->second.begin(), it->second.end());
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+    }
+
+ private:
+    static constexpr size_t kMaxSamples = 32;
+    static constexpr double kFailurePenaltyMs = 60 * 1000;
+    static constexpr double kUnmeasured = 1e12;
+
+    std::map<std::string, std::deque<double>> samples_;
+};
+
+// Config sections carrying the macOS and iOS/iPadOS SOFA feeds
+const std::string kConfigMacOSFeedKey = "sofa_macos_data_feed";
+const std::string kConfigIOSFeedKey = "sofa_ios_data_feed";
+
+// Snapshots delivered through the osquery config, so the fleet server sends
+// the feed once to every host instead of each host fetching it from upstream:
+//   {"sofa_macos_data_feed": { ...contents of macos_data_feed.json... },
+//    "sofa_ios_data_feed": "...base64 of a compact index..."}
+// Config parser plugins only run inside osqueryd, so the extension asks the
+// core for its config with load(). Used by the tables when
+// --macos_compatibility_feed_source=config.
+class ConfigFeeds {
+ public:
+    static ConfigFeeds& instance() {
+        static ConfigFeeds feeds;
+        return feeds;
+    }
+
+    // Read the feeds from the config the core currently has. A source whose
+    // text is unchanged since the last load is not parsed again; a section
+    // that is missing or invalid keeps the snapshot from before.
+    void load() {
+        PluginResponse response;
+        auto status = Registry::call("config", {{"action", "genConfig"}}, response);
+        if (!status.ok()) {
+            SOFA_LOG_LIMITED(WARNING, "config",
+                             "Failed to read the osquery config: " << status.getMessage());
+        }
+        for (const auto& sources : response) {
+            for (const auto& source : sources) {
+                size_t hash = std::hash<std::string>()(source.second);
+                auto seen = source_hashes_.find(source.first);
+                if (seen != source_hashes_.end() && seen->second == hash) {
+                    continue;
+                }
+                source_hashes_[source.first] = hash;
+                update(source.first, source.second);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            loaded_ = true;
+        }
+        loaded_cv_.notify_all();
+    }
+
+    std::shared_ptr<const SofaSnapshot> get(const std::string& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = snapshots_.find(key);
+        return it == snapshots_.end() ? nullptr : it->second;
+    }
+
+    // The snapshot for key once the config has been read, waiting for the
+    // first load() at most timeout; error is why the section was rejected
+    std::shared_ptr<const SofaSnapshot> get(const std::string& key,
+                                            std::chrono::milliseconds timeout,
+                                            std::string& error) const {
+        std::unique_lock<std::mutex> lock(mutex_);
+        loaded_cv_.wait_for(lock, timeout, [this] { return loaded_; });
+        auto it = errors_.find(key);
+        error = it == errors_.end() ? "" : it->second;
+        auto snapshot = snapshots_.find(key);
+        return snapshot == snapshots_.end() ? nullptr : snapshot->second;
+    }
+
+    // Take the feed sections of one config source. A feed is the JSON
+    // object itself, or a string holding a base64 compact index. load()
+    // calls this for every source whose text changed.
+    void update(const std::string& source, const std::string& text) {
+        auto config = nlohmann::json::parse(text, nullptr, false);
+        if (!config.is_object()) {
+            return;
+        }
+        for (const auto& key : {kConfigMacOSFeedKey, kConfigIOSFeedKey}) {
+            auto it = config.find(key);
+            if (it == config.end() || it->is_null() || (it->is_object() && it->empty())) {
+                continue;
+            }
+
+            std::string feed = it->is_string() ? base64::decode(it->get<std::string>())
+                                               : it->dump();
+            std::string error;
+            auto snapshot = SofaSnapshot::parse(feed, error);
+            if (!snapshot) {
+                error = "Invalid SOFA feed " + key + " in config from " + source + ": " + error;
+                SOFA_LOG_LIMITED(ERROR, "config " + key, error);
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (snapshot) {
+                snapshots_[key] = std::move(snapshot);
+                errors_.erase(key);
+            } else {
+                errors_[key] = error;
+            }
+        }
+    }
+
+ private:
+    mutable std::mutex mutex_;
+    mutable std::condition_variable loaded_cv_;
+    bool loaded_ = false;
+    std::map<std::string, std::shared_ptr<const SofaSnapshot>> snapshots_;
+    std::map<std::string, std::string> errors_;
+    // Hash of each config source's text at the last load (load() only)
+    std::map<std::string, size_t> source_hashes_;
+};
+
+// Cache files kept for one feed format
+struct FeedFiles {
+    std::string cache;
+    std::string etag;
+    std::string hash;
+    std::string quarantined;
+    // Whether the body is a compact index rather than JSON
+    bool compact;
+};
+
+// Model identifiers are used in slice URLs and cache file names; keep the
+// characters they are made of and escape the rest
+static std::string escapeModel(const std::string& model, bool for_url) {
+    std::string out;
+    for (unsigned char c : model) {
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || (for_url && c == ',')) {
+            out.push_back(static_cast<char>(c));
+        } else if (for_url) {
+            char escaped[4];
+            snprintf(escaped, sizeof(escaped), "%%%02X", c);
+            out += escaped;
+        } else {
+            out.push_back('_');
+        }
+    }
+    return out;
+}
+
+// Cache directory shared by every feed, without a trailing slash
+static std::string cacheDir() {
+    std::string dir = FLAGS_macos_compatibility_cache_dir;
+    while (dir.size() > 1 && dir.back() == '/') {
+        dir.pop_back();
+    }
+    return dir;
+}
+
+const std::string kUserAgent = "SOFA-osquery-macOSCompatibilityCheck/1.0";
+
+// SOFA feed URLs, and the compact index and per-model slice paths on a mirror
+const std::string kSofaUrl = "https://sofafeed.macadmins.io/v1/macos_data_feed.json";
+const std::string kSofaIOSUrl = "https://sofafeed.macadmins.io/v1/ios_data_feed.json";
+const std::string kMirrorIndexPath = "/v1/macos_data_feed.bin";
+const std::string kMirrorSlicePath = "/v1/slices/";
+
+// Temporary files older than this were left behind by a crashed writer
+static constexpr int64_t kStaleTempSeconds = 3600;
+
+// Whether name is a temporary file createTempFile() made for a cache file of
+// the feed with this stem: <stem>.json, <stem>.bin, or <stem>_ followed by
+// an escaped model or "bin" and one of .bin, _etag.txt and _hash.txt, all
+// suffixed with .tmp. and six mkstemp() characters
+static bool isOwnTempFile(std::string_view name, std::string_view stem) {
+    static constexpr std::string_view kTemp = ".tmp.";
+    static constexpr size_t kUniqueChars = 6;
+    if (name.size() < stem.size() + kTemp.size() + kUniqueChars ||
+        name.substr(0, stem.size()) != stem) {
+        return false;
+    }
+    size_t temp = name.size() - kTemp.size() - kUniqueChars;
+    if (name.substr(temp, kTemp.size()) != kTemp) {
+        return false;
+    }
+    for (char c : name.substr(temp + kTemp.size())) {
+        if (!isalnum(static_cast<unsigned char>(c))) {
+            return false;
+        }
+    }
+
+    std::string_view file = name.substr(stem.size(), temp - stem.size());
+    if (file == ".json" || file == ".bin" || file == "_etag.txt" || file == "_hash.txt") {
+        return true;
+    }
+    for (std::string_view suffix : {".bin", "_etag.txt", "_hash.txt"}) {
+        if (file.size() <= suffix.size() + 1 || file[0] != '_' ||
+            file.substr(file.size() - suffix.size()) != suffix) {
+            continue;
+        }
+        auto model = file.substr(1, file.size() - suffix.size() - 1);
+        return std::all_of(model.begin(), model.end(), [](char c) {
+            return isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' || c == '_';
+        });
+    }
+    return false;
+}
+
+// Remove the feed's temporary cache files that no writer will rename
+// anymore. Young ones may still be in use by another process and are left
+// alone, and files of other SOFA consumers sharing the directory are never
+// touched.
+static void removeStaleTempFiles(const std::string& dir, const std::string& stem) {
+    DIR* handle = opendir(dir.c_str());
+    if (handle == nullptr) {
+        return;
+    }
+    int64_t cutoff = static_cast<int64_t>(std::time(nullptr)) - kStaleTempSeconds;
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (!isOwnTempFile(name, stem)) {
+            continue;
+        }
+        std::string path = dir + "/" + name;
+        auto identity = FileIdentity::of(path);
+        if (identity.exists() && identity.mtime_ns / 1000000000LL < cutoff) {
+            VLOG(1) << "Removing stale SOFA temporary file: " << path;
+            unlink(path.c_str());
+        }
+    }
+    closedir(handle);
+}
+
+// Create cache directory if it doesn't exist
+static bool ensureCacheDir() {
+    try {
+        std::string dir = cacheDir();
+        if (access(dir.c_str(), F_OK) != 0) {
+            if (mkdir(dir.c_str(), 0755) != 0) {
+                SOFA_LOG_LIMITED(ERROR, "cache dir", "Failed to create cache directory: " << dir);
+                return false;
+            }
+        }
+        return true;
+    } catch (const std::exception& e) {
+        SOFA_LOG_LIMITED(ERROR, "cache dir",
+                         "Exception creating cache directory: " << e.what());
+        return false;
+    }
+}
+
+// Read file content
+static std::string readFile(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        return "";
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+// Split a comma-separated URL list, or return the fallback if it is empty
+static std::vector<std::string> splitUrls(const std::string& list, const std::string& fallback) {
+    std::vector<std::string> urls;
+    std::stringstream stream(list);
+    std::string url;
+    while (std::getline(stream, url, ',')) {
+        url.erase(0, url.find_first_not_of(" \t"));
+        url.erase(url.find_last_not_of(" \t") + 1);
+        if (!url.empty()) {
+            urls.push_back(url);
+        }
+    }
+    if (urls.empty()) {
+        urls.push_back(fallback);
+    }
+    return urls;
+}
+
+// Static description of one SOFA feed
+struct FeedSpec {
+    // Name used in logs and in --macos_compatibility_feeds
+    std::string name;
+    // Cache file stem in the cache directory
+    std::string stem;
+    // Upstream URLs of the JSON feed
+    std::function<std::vector<std::string>()> urls;
+    // Whether sofa_mirror serves this feed as a compact index and slices
+    bool mirrored;
+};
+
+// One SOFA feed kept fresh by the FeedEngine: its cache files, the current
+// snapshot and etag, and the integrity and identity state of the cache.
+// Everything except the published result is only used on the engine thread.
+class SofaFeed {
+ public:
+    // Where one refresh stage fetches from
+    struct Stage {
+        const FeedFiles* files;
+        std::vector<std::string> urls;
+        std::string label;
+        // Short name of the source, as macos_compatibility_health reports it
+        std::string source;
+    };
+
+    // How a stage ended
+    struct Outcome {
+        std::shared_ptr<const SofaSnapshot> snapshot;
+        // The cache behind a 304 was quarantined: ask again unconditionally
+        bool retry = false;
+    };
+
+    // Routine events, counted rather than logged one by one; logSummary()
+    // reports them periodically
+    enum Counter {
+        kQueries,
+        kRefreshes,
+        kNotModified,
+        kUpdated,
+        kStale,
+        kFailedRequests,
+        kHedged,
+        kFallbacks,
+        kCounterCount
+    };
+
+    SofaFeed(FeedSpec spec, CacheWriter& writer, std::function<void()> wake)
+        : spec_(std::move(spec)),
+          cache_dir_(cacheDir()),
+          json_files_{cache_dir_ + "/" + spec_.stem + ".json",
+                      cache_dir_ + "/" + spec_.stem + "_etag.txt",
+                      cache_dir_ + "/" + spec_.stem + "_hash.txt",
+                      cache_dir_ + "/" + spec_.stem + ".json.corrupt",
+                      false},
+          index_files_{cache_dir_ + "/" + spec_.stem + ".bin",
+                       cache_dir_ + "/" + spec_.stem + "_bin_etag.txt",
+                       cache_dir_ + "/" + spec_.stem + "_bin_hash.txt",
+                       cache_dir_ + "/" + spec_.stem + ".bin.corrupt",
+                       true},
+          files_(&json_files_),
+          writer_(writer),
+          wake_(std::move(wake)) {}
+    SofaFeed(const SofaFeed&) = delete;
+    SofaFeed& operator=(const SofaFeed&) = delete;
+
+    const FeedSpec& spec() const { return spec_; }
+
+    // Model whose slice to prefer; set by queries before the first refresh.
+    // Returns whether it changed.
+    bool setModel(const std::string& model) {
+        std::lock_guard<std::mutex> lock(result_mutex_);
+        if (model_ == model) {
+            return false;
+        }
+        model_ = model;
+        return true;
+    }
+
+    // The latest published result. Until there is one, wait for it at most
+    // timeout. Returns nullptr with an empty error when no data is available.
+    std::shared_ptr<const SofaSnapshot> result(std::chrono::milliseconds timeout,
+                                               std::string& error) {
+        std::unique_lock<std::mutex> lock(result_mutex_);
+        result_ready_.wait_for(lock, timeout, [this] { return has_result_; });
+        error = error_;
+        return published_;
+    }
+
+    uint64_t downloadBytes() const { return download_bytes_; }
+    uint64_t downloadBytesTotal() const { return download_bytes_total_; }
+
+    // In-memory state reported by macos_compatibility_health
+    struct Health {
+        bool loaded = false;
+        // Unix times: when the current snapshot's data was fetched, when
+        // the last refresh ended and when a source last answered
+        int64_t fetched_time = 0;
+        int64_t refresh_time = 0;
+        int64_t success_time = 0;
+        // Which source the current snapshot came from and the URL that
+        // answered, see SofaFeed::answered
+        std::string source;
+        std::string source_url;
+        std::string error;
+        // Refreshes in a row that no source answered
+        unsigned failures = 0;
+        std::string cache_file;
+        bool cache_verified = false;
+        uint64_t quarantined = 0;
+    };
+
+    Health health() const {
+        std::lock_guard<std::mutex> lock(result_mutex_);
+        Health health = health_;
+        health.quarantined = quarantined_;
+        return health;
+    }
+
+    unsigned failures() const {
+        std::lock_guard<std::mutex> lock(result_mutex_);
+        return health_.failures;
+    }
+
+    // When the engine next refreshes this feed; set from the engine thread
+    void setNextRefresh(std::chrono::steady_clock::time_point at) {
+        next_refresh_ = at.time_since_epoch().count();
+    }
+
+    // Whole seconds until the next refresh, 0 while one is due or running
+    uint64_t secondsToRefresh() const {
+        auto at = std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(next_refresh_.load()));
+        auto left = std::chrono::duration_cast<std::chrono::seconds>(
+            at - std::chrono::steady_clock::now());
+        return left.count() > 0 ? static_cast<uint64_t>(left.count()) : 0;
+    }
+
+    LatencyStats& latency() { return latency_; }
+
+    void count(Counter counter) { counters_[counter].fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t counter(Counter counter) const {
+        return counters_[counter].load(std::memory_order_relaxed);
+    }
+
+    // Log what happened since the last summary in one line; stays quiet
+    // when nothing did
+    void logSummary(std::chrono::seconds period) {
+        std::array<uint64_t, kCounterCount> delta;
+        bool any = false;
+        for (size_t i = 0; i < kCounterCount; i++) {
+            uint64_t value = counters_[i].load(std::memory_order_relaxed);
+            delta[i] = value - reported_[i];
+            reported_[i] = value;
+            any = any || delta[i] != 0;
+        }
+        if (!any) {
+            return;
+        }
+        LOG(INFO) << "SOFA " << spec_.name << " feed, last " << period.count() << "s: "
+                  << delta[kQueries] << " queries, " << delta[kRefreshes] << " refreshes ("
+                  << delta[kNotModified] << " not modified, " << delta[kUpdated]
+                  << " updated, " << delta[kStale] << " without a fresh answer), "
+                  << delta[kFailedRequests] << " failed and " << delta[kHedged]
+                  << " hedged requests, " << delta[kFallbacks] << " source fallbacks";
+    }
+
+    // Sources of one refresh, in order of preference. With a mirror that
+    // serves this feed: the host's slice, the full index, then upstream.
+    std::vector<Stage> stages() {
+        std::vector<Stage> stages;
+        std::string mirror = FLAGS_macos_compatibility_mirror_url;
+        while (!mirror.empty() && mirror.back() == '/') {
+            mirror.pop_back();
+        }
+        if (spec_.mirrored && !mirror.empty()) {
+            std::string model;
+            {
+                std::lock_guard<std::mutex> lock(result_mutex_);
+                model = model_;
+            }
+            if (!model.empty()) {
+                stages.push_back({&sliceFiles(model),
+                                  {mirror + kMirrorSlicePath + escapeModel(model, true) + ".bin"},
+                                  "the mirror's slice for " + model, "mirror_slice"});
+            }
+            stages.push_back(
+                {&index_files_, {mirror + kMirrorIndexPath}, "the mirror's index", "mirror_index"});
+        }
+        stages.push_back({&json_files_, spec_.urls(), "the upstream feed", "upstream"});
+        return stages;
+    }
+
+    // With --macos_compatibility_watch_cache, watch the caches of every
+    // stage: the JSON one other SOFA consumers share as well as the mirror's
+    void watchCaches(const std::vector<Stage>& stages) {
+        if (!FLAGS_macos_compatibility_watch_cache) {
+            return;
+        }
+        std::set<std::string> file_names;
+        for (const auto& stage : stages) {
+            file_names.insert(stage.files->cache.substr(cache_dir_.size() + 1));
+        }
+        // The stages only change when the host's model becomes known
+        if ((watcher_ && file_names == watched_) || !prepareCacheDir()) {
+            return;
+        }
+        watcher_.reset();
+        watched_ = file_names;
+        watcher_ = std::make_unique<CacheDirWatcher>(cache_dir_, std::move(file_names), [this] {
+            sync_requested_ = true;
+            wake_();
+        });
+        if (!watcher_->start()) {
+            LOG(WARNING) << "Failed to watch SOFA cache directory: " << cache_dir_;
+        }
+    }
+
+    // Publish the newest cache found, so queries have data before the first
+    // network round trip completes
+    void loadAnyCache(const std::vector<Stage>& stages) {
+        if (snapshot_) {
+            return;
+        }
+        for (const auto& stage : stages) {
+            if (access(stage.files->cache.c_str(), F_OK) != 0) {
+                continue;
+            }
+            use(*stage.files);
+            std::string error;
+            if (loadCache(error)) {
+                return;
+            }
+        }
+    }
+
+    // Get ready to fetch into files and pick the etag to send. Returns
+    // false, with the stage's outcome set, when it must not fetch at all.
+    bool prepare(const FeedFiles& files, std::string& etag, Outcome& outcome, std::string& error) {
+        if (!prepareCacheDir()) {
+            return false;
+        }
+        use(files);
+
+        // Pick up a cache file another process refreshed before asking the
+        // server. Another stage's cache is only read if that stage wins.
+        if (current(files)) {
+            syncWithCacheFile(files);
+        }
+
+        // Stay under the watchdog limit: serve the cache instead of refreshing
+        uint64_t rss_limit = FLAGS_macos_compatibility_refresh_rss_limit_mb * 1024 * 1024;
+        if (rss_limit > 0 && getResourceUsage().rss_bytes > rss_limit) {
+            SOFA_LOG_LIMITED(WARNING, "rss limit",
+                             "RSS above " << FLAGS_macos_compatibility_refresh_rss_limit_mb
+                                          << " MB, skipping SOFA refresh");
+            outcome.snapshot = loadCachedSnapshot(0, error);
+            return false;
+        }
+
+        // If we have a cached etag, use it
+        etag = current(files) ? snapshot_etag_ : readFile(files.etag);
+        return true;
+    }
+
+    // Turn the stage's final transfer into its outcome: the new index of a
+    // 200, the cached one on a 304, or whatever cache is left on failures.
+    // transfer is nullptr when no request could be made.
+    Outcome conclude(const Stage& stage,
+                     FeedTransfer* transfer,
+                     std::string& error,
+                     bool revalidate) {
+        Outcome outcome;
+        if (!transfer) {
+            return outcome;
+        }
+        const FeedFiles& files = *stage.files;
+        FeedDownload& download = transfer->download();
+        CURLcode res = transfer->result();
+
+        if (res == CURLE_FILESIZE_EXCEEDED || download.oversized()) {
+            SOFA_LOG_LIMITED(ERROR, spec_.name + " oversized",
+                             "SOFA feed exceeds " << FLAGS_macos_compatibility_max_feed_bytes
+                                                  << " bytes, transfer aborted");
+            outcome.snapshot = loadCachedSnapshot(0, error);
+            return outcome;
+        }
+
+        if (res != CURLE_OK) {
+            SOFA_LOG_LIMITED(ERROR, spec_.name + " request",
+                             "SOFA request failed: " << curl_easy_strerror(res));
+            return outcome;
+        }
+
+        long http_code = transfer->httpCode();
+
+        // If we got 304 Not Modified, use cached json
+        if (http_code == 304) {
+            count(kNotModified);
+            if (current(files)) {
+                answered(stage, *transfer);
+                outcome.snapshot = snapshot_;
+                return outcome;
+            }
+            outcome.snapshot = loadCache(error);
+            if (outcome.snapshot) {
+                // The server just confirmed the cached copy
+                answered(stage, *transfer);
+            }
+            if (!outcome.snapshot && revalidate) {
+                // The cache was quarantined along with its etag, fetch a fresh copy
+                error.clear();
+                outcome.retry = true;
+            }
+            return outcome;
+        }
+
+        // If we got new data, it is already indexed: publish it and leave
+        // persistence to the background writer
+        if (http_code == 200) {
+            auto snapshot = transfer->snapshot();
+            if (!snapshot) {
+                error = transfer->parseError();
+                return outcome;
+            }
+
+            count(kUpdated);
+            std::string new_etag = transfer->etag();
+            snapshot_ = snapshot;
+            snapshot_etag_ = new_etag;
+            snapshot_files_ = &files;
+            answered(stage, *transfer);
+            outcome.snapshot = snapshot;
+
+            // The etag and hash only land once their body is in place
+            std::vector<CacheWriter::File> writes;
+            if (!download.persisted()) {
+                std::string body = download.takeBody();
+                if (body.empty()) {
+                    return outcome;
+                }
+                writes.emplace_back(files.cache, std::move(body));
+            }
+            writes.emplace_back(files.hash, download.hash());
+            if (!new_etag.empty()) {
+                writes.emplace_back(files.etag, new_etag);
+            }
+            if (download.persisted()) {
+                setCacheIdentity(files, FileIdentity::of(files.cache));
+            }
+            // Our own write must not look like another process's refresh
+            const FeedFiles* written = &files;
+            writer_.submit(files.cache, std::move(writes), [this, written] {
+                setCacheIdentity(*written, FileIdentity::of(written->cache));
+            });
+            cache_verified_ = true;
+            return outcome;
+        }
+
+        outcome.snapshot = loadCachedSnapshot(http_code, error);
+        return outcome;
+    }
+
+    // Publish the result of a refresh. A refresh that produced nothing keeps
+    // the snapshot from before it. fresh tells whether a source answered;
+    // failure describes the last failed request.
+    void finishRefresh(std::shared_ptr<const SofaSnapshot> snapshot,
+                       std::string error,
+                       uint64_t bytes,
+                       bool fresh,
+                       const std::string& failure) {
+        count(kRefreshes);
+        if (!fresh) {
+            count(kStale);
+        }
+        {
+            std::lock_guard<std::mutex> lock(result_mutex_);
+            health_.refresh_time = std::time(nullptr);
+            health_.failures = fresh ? 0 : health_.failures + 1;
+            if (fresh) {
+                health_.success_time = health_.refresh_time;
+            }
+            health_.error = error.empty() && !fresh ? failure : error;
+        }
+        if (!snapshot && snapshot_) {
+            SOFA_LOG_LIMITED(WARNING, spec_.name + " unusable",
+                             "No SOFA " << spec_.name << " source usable"
+                                        << (error.empty() ? "" : " (" + error + ")")
+                                        << ", keeping the last snapshot");
+            snapshot = snapshot_;
+            error.clear();
+        }
+        download_bytes_ = bytes;
+        download_bytes_total_ += bytes;
+        publish(std::move(snapshot), std::move(error));
+    }
+
+    // Stop watching the cache directory; the watcher's callback wakes the
+    // engine. Only called once the engine thread has stopped.
+    void stopWatching() { watcher_.reset(); }
+
+    // Reload the cache the snapshot came from if the watcher saw it change
+    // since the last call, or load the first cache to appear
+    void syncIfRequested() {
+        if (!sync_requested_.exchange(false)) {
+            return;
+        }
+        if (snapshot_files_) {
+            use(*snapshot_files_);
+            syncWithCacheFile(*snapshot_files_);
+        } else {
+            loadAnyCache(stages());
+        }
+    }
+
+ private:
+    // Create the cache directory and, once per process, sweep this feed's
+    // stale temporary files from it
+    bool prepareCacheDir() {
+        if (!ensureCacheDir()) {
+            return false;
+        }
+        std::call_once(swept_, [this] { removeStaleTempFiles(cache_dir_, spec_.stem); });
+        return true;
+    }
+
+    // Switch to the cache files of another source
+    void use(const FeedFiles& files) {
+        // Integrity state belongs to the cache it was checked against
+        if (files_ != &files) {
+            files_ = &files;
+            cache_verified_ = false;
+        }
+    }
+
+    // The current snapshot's data was just fetched or confirmed by stage
+    void answered(const Stage& stage, const FeedTransfer& transfer) {
+        fetched_time_ = std::time(nullptr);
+        snapshot_source_ = stage.source;
+        snapshot_url_ = transfer.url();
+    }
+
+    // Whether the current snapshot came from files
+    bool current(const FeedFiles& files) const {
+        return snapshot_ && snapshot_files_ == &files;
+    }
+
+    void publish(std::shared_ptr<const SofaSnapshot> snapshot, std::string error) {
+        {
+            std::lock_guard<std::mutex> lock(result_mutex_);
+            bool latest = snapshot && snapshot == snapshot_;
+            health_.fetched_time = latest ? fetched_time_ : 0;
+            health_.source = latest ? snapshot_source_ : "";
+            health_.source_url = latest ? snapshot_url_ : "";
+            health_.loaded = snapshot != nullptr;
+            health_.cache_file = current(*files_) ? files_->cache : "";
+            health_.cache_verified = cache_verified_;
+            published_ = std::move(snapshot);
+            error_ = std::move(error);
+            has_result_ = true;
+        }
+        result_ready_.notify_all();
+    }
+
+    // Cache files of one model's slice; the map keeps references stable
+    const FeedFiles& sliceFiles(const std::string& model) {
+        auto it = slice_files_.find(model);
+        if (it == slice_files_.end()) {
+            std::string base = cache_dir_ + "/" + spec_.stem + "_" + escapeModel(model, false);
+            it = slice_files_.emplace(model, FeedFiles{base + ".bin", base + "_etag.txt",
+                                                       base + "_hash.txt", base + ".bin.corrupt",
+                                                       true}).first;
+        }
+        return it->second;
+    }
+
+    // If we couldn't get new data but have cached data, use it
+    std::shared_ptr<const SofaSnapshot> loadCachedSnapshot(long http_code, std::string& error) {
+        // A snapshot from another source is only the last resort, see finishRefresh
+        if (current(*files_)) {
+            SOFA_LOG_LIMITED(WARNING, spec_.name + " cached",
+                             "Failed to fetch new data (HTTP " << http_code
+                                                               << "), using cached data");
+            return snapshot_;
+        }
+        if (access(files_->cache.c_str(), F_OK) == 0) {
+            SOFA_LOG_LIMITED(WARNING, spec_.name + " cached",
+                             "Failed to fetch new data (HTTP " << http_code
+                                                               << "), using cached data");
+            return loadCache(error);
+        }
+
+        SOFA_LOG_LIMITED(ERROR, spec_.name + " no cache",
+                         "Failed to fetch SOFA data (HTTP " << http_code
+                                                            << ") and no cache available");
+        return nullptr;
+    }
+
+    // Reload the cache file if it is not the one the current snapshot came
+    // from, e.g. because another SOFA consumer refreshed it. A single stat()
+    // decides; an unchanged file is never reread. files must be in use.
+    void syncWithCacheFile(const FeedFiles& files) {
+        auto identity = FileIdentity::of(files.cache);
+        {
+            std::lock_guard<std::mutex> lock(identity_mutex_);
+            auto known = cache_identities_.find(&files);
+            if (!identity.exists() ||
+                (known != cache_identities_.end() && identity == known->second)) {
+                return;
+            }
+        }
+
+        // A file written elsewhere has to pass the integrity check again
+        cache_verified_ = false;
+        std::string error;
+        if (!loadCache(error)) {
+            SOFA_LOG_LIMITED(WARNING, spec_.name + " changed cache",
+                             "Ignoring changed SOFA cache: " << error);
+        }
+    }
+
+    void setCacheIdentity(const FeedFiles& files, const FileIdentity& identity) {
+        std::lock_guard<std::mutex> lock(identity_mutex_);
+        cache_identities_[&files] = identity;
+    }
+
+    // Load and publish the cached feed. Its integrity hash is checked once
+    // per process; a cache that fails the check or does not parse is
+    // quarantined.
+    std::shared_ptr<const SofaSnapshot> loadCache(std::string& error) {
+        const FeedFiles& files = *files_;
+        auto identity = FileIdentity::of(files.cache);
+        std::string expected_hash;
+        if (!cache_verified_) {
+            expected_hash = readFile(files.hash);
+            // A hash older than the feed belongs to a write still in flight,
+            // leave that case to the parse
+            if (!expected_hash.empty() && expected_hash != FeedHash::ofFile(files.cache) &&
+                FileIdentity::of(files.hash).mtime_ns >= identity.mtime_ns) {
+                error = "SOFA cache failed its integrity check";
+                quarantineCache(error);
+                return nullptr;
+            }
+        }
+
+        auto snapshot = SofaSnapshot::load(files.cache, error);
+        if (!snapshot) {
+            quarantineCache(error);
+            return nullptr;
+        }
+
+        // Caches written before hashes were kept get one now, written like
+        // the cache itself so a crash cannot leave a torn hash behind
+        if (!cache_verified_ && expected_hash.empty()) {
+            writer_.submitUnlessPending(files.cache, {{files.hash, FeedHash::ofFile(files.cache)}});
+        }
+        cache_verified_ = true;
+        setCacheIdentity(files, identity);
+        snapshot_ = snapshot;
+        snapshot_etag_ = readFile(files.etag);
+        snapshot_files_ = &files;
+        // The cache was written when its data was fetched
+        fetched_time_ = static_cast<int64_t>(identity.mtime_ns / 1000000000);
+        snapshot_source_ = "cache";
+        snapshot_url_.clear();
+        publish(snapshot, "");
+        return snapshot;
+    }
+
+    // Move a bad cache aside and drop its etag, so the next request is
+    // unconditional and its 200 replaces the cache
+    void quarantineCache(const std::string& reason) {
+        LOG(ERROR) << "Quarantining SOFA cache: " << reason;
+        quarantined_++;
+        rename(files_->cache.c_str(), files_->quarantined.c_str());
+        unlink(files_->etag.c_str());
+        unlink(files_->hash.c_str());
+        cache_verified_ = false;
+    }
+
+    FeedSpec spec_;
+    // --macos_compatibility_cache_dir when the feed was created
+    const std::string cache_dir_;
+    const FeedFiles json_files_;
+    // The compact index from a mirror is cached apart from the JSON, which
+    // other SOFA consumers may share
+    const FeedFiles index_files_;
+    // Cache files of per-model slices, by model identifier
+    std::map<std::string, FeedFiles> slice_files_;
+    std::once_flag swept_;
+
+    // Cache files of the source being refreshed
+    const FeedFiles* files_;
+
+    // The most recently loaded snapshot, the etag it was served with and the
+    // cache files of the source it came from
+    std::shared_ptr<const SofaSnapshot> snapshot_;
+    std::string snapshot_etag_;
+    const FeedFiles* snapshot_files_ = nullptr;
+    // Unix time the snapshot's data was fetched or last confirmed by a 304,
+    // and the stage and URL that answered; "cache" and no URL when it was
+    // loaded from a cache file
+    int64_t fetched_time_ = 0;
+    std::string snapshot_source_;
+    std::string snapshot_url_;
+
+    // Whether files_->cache has passed its integrity check in this process
+    bool cache_verified_ = false;
+
+    // stat() identity of each cache file as last loaded or written by this
+    // process, by its FeedFiles; updated from the writer thread
+    std::mutex identity_mutex_;
+    std::map<const FeedFiles*, FileIdentity> cache_identities_;
+
+    // Per-URL response times, ordering mirrors and timing hedged requests
+    LatencyStats latency_;
+
+    // Event counts, and their values at the last summary (engine thread only)
+    std::array<std::atomic<uint64_t>, kCounterCount> counters_{};
+    std::array<uint64_t, kCounterCount> reported_{};
+
+    CacheWriter& writer_;
+    std::function<void()> wake_;
+    std::atomic<bool> sync_requested_{false};
+
+    // What queries see, guarded by result_mutex_
+    mutable std::mutex result_mutex_;
+    std::condition_variable result_ready_;
+    std::shared_ptr<const SofaSnapshot> published_;
+    std::string error_;
+    bool has_result_ = false;
+    std::string model_;
+    Health health_;
+
+    // Caches moved aside for failing their integrity check or parse
+    std::atomic<uint64_t> quarantined_{0};
+
+    // Bytes on the wire, headers included: of the last refresh and over the
+    // process lifetime
+    std::atomic<uint64_t> download_bytes_{0};
+    std::atomic<uint64_t> download_bytes_total_{0};
+
+    // steady_clock ticks of the next refresh
+    std::atomic<std::chrono::steady_clock::rep> next_refresh_{0};
+
+    // Started on first use when --macos_compatibility_watch_cache is set,
+    // and the cache file names it watches; destroyed first so its callback
+    // never outlives the feed
+    std::set<std::string> watched_;
+    std::unique_ptr<CacheDirWatcher> watcher_;
+};
+
+// One refresh of a feed in flight on the engine. It works through the feed's
+// stages in order; within a stage, requests go to the fastest URL first and
+// the next URL is asked once the requests in flight have all failed or none
+// has completed within the hedge delay. The first usable response wins and
+// the rest are cancelled.
+class RefreshJob {
+ public:
+    RefreshJob(SofaFeed& feed, CURLM* multi)
+        : feed_(feed), multi_(multi), stages_(feed.stages()) {
+        feed_.watchCaches(stages_);
+        feed_.loadAnyCache(stages_);
+        startStage(true);
+    }
+    RefreshJob(const RefreshJob&) = delete;
+    RefreshJob& operator=(const RefreshJob&) = delete;
+
+    ~RefreshJob() { cancel(); }
+
+    bool done() const { return done_; }
+
+    // Whether a source answered, as opposed to the result coming from a cache
+    bool fresh() const { return fresh_; }
+
+    bool owns(CURL* handle) const {
+        return std::any_of(running_.begin(), running_.end(),
+                           [handle](const auto& t) { return t->handle() == handle; });
+    }
+
+    // Start the hedged request that is due, if any, or give up on a stage
+    // that ran past its deadline
+    void launchDue(std::chrono::steady_clock::time_point now) {
+        if (!done_ && !running_.empty() && now >= stage_deadline_) {
+            expire();
+        } else if (!done_ && !running_.empty() && next_ < order_.size() && now >= hedge_at_) {
+            feed_.count(SofaFeed::kHedged);
+            launch();
+        }
+    }
+
+    // When launchDue() next has work, or time_point::max()
+    std::chrono::steady_clock::time_point nextDue() const {
+        if (done_ || running_.empty()) {
+            return std::chrono::steady_clock::time_point::max();
+        }
+        return next_ < order_.size() ? std::min(hedge_at_, stage_deadline_) : stage_deadline_;
+    }
+
+    void onDone(CURL* handle, CURLcode result) {
+        auto it = std::find_if(running_.begin(), running_.end(),
+                               [handle](const auto& t) { return t->handle() == handle; });
+        if (it == running_.end()) {
+            return;
+        }
+        auto transfer = std::move(*it);
+        running_.erase(it);
+        curl_multi_remove_handle(multi_, transfer->handle());
+        bytes_ += transfer->wireBytes();
+
+        if (transfer->complete(result)) {
+            feed_.latency().record(transfer->url(), transfer->elapsedMs());
+            endStage(std::move(transfer), true);
+            return;
+        }
+        feed_.latency().recordFailure(transfer->url());
+        feed_.count(SofaFeed::kFailedRequests);
+        if (transfer->result() != CURLE_OK) {
+            failure_ = transfer->url() + ": " + curl_easy_strerror(transfer->result());
+            SOFA_LOG_LIMITED(WARNING, "request " + transfer->url(),
+                             "SOFA request to " << transfer->url() << " failed: "
+                                                << curl_easy_strerror(transfer->result()));
+        } else {
+            failure_ = transfer->url() + ": HTTP " + std::to_string(transfer->httpCode());
+        }
+        failed_ = std::move(transfer);
+        if (running_.empty()) {
+            launch();
+        }
+    }
+
+ private:
+    // Hedge delay bounds while no p95 has been observed yet
+    static constexpr double kDefaultHedgeDelayMs = 2000;
+    static constexpr double kMinHedgeDelayMs = 50;
+    // How long a stage may wait for an answer before the next source is tried
+    static constexpr std::chrono::seconds kStageTimeout{120};
+
+    double hedgeDelay() const {
+        if (FLAGS_macos_compatibility_hedge_delay_ms > 0) {
+            return static_cast<double>(FLAGS_macos_compatibility_hedge_delay_ms);
+        }
+        return std::max(kMinHedgeDelayMs,
+                        feed_.latency().percentile(order_.front(), 0.95, kDefaultHedgeDelayMs));
+    }
+
+    void startStage(bool revalidate) {
+        if (stage_ >= stages_.size()) {
+            finish(nullptr);
+            return;
+        }
+        const auto& stage = stages_[stage_];
+        revalidate_ = revalidate;
+        failed_.reset();
+        SofaFeed::Outcome outcome;
+        if (!feed_.prepare(*stage.files, etag_, outcome, error_)) {
+            handle(outcome);
+            return;
+        }
+        order_ = feed_.latency().order(stage.urls);
+        next_ = 0;
+        stage_deadline_ = std::chrono::steady_clock::now() + kStageTimeout;
+        launch();
+    }
+
+    // The stage is out of time: count its requests in flight as failed
+    // and move on
+    void expire() {
+        for (auto& transfer : running_) {
+            curl_multi_remove_handle(multi_, transfer->handle());
+            bytes_ += transfer->wireBytes();
+            feed_.latency().recordFailure(transfer->url());
+            feed_.count(SofaFeed::kFailedRequests);
+            failure_ = transfer->url() + ": no answer within " +
+                       std::to_string(kStageTimeout.count()) + "s";
+        }
+        SOFA_LOG_LIMITED(WARNING, "stage timeout " + stages_[stage_].label,
+                         "No SOFA answer from " << stages_[stage_].label << " within "
+                                                << kStageTimeout.count() << "s");
+        running_.clear();
+        endStage(std::move(failed_), false);
+    }
+
+    // Start the next URL of the stage; ends the stage when none is left and
+    // nothing is in flight
+    void launch() {
+        const FeedFiles& files = *stages_[stage_].files;
+        while (next_ < order_.size()) {
+            auto transfer = std::make_unique<FeedTransfer>(order_[next_++], etag_, kUserAgent,
+                                                           files.cache, files.compact);
+            if (!transfer->handle()) {
+                SOFA_LOG_LIMITED(ERROR, "curl init", "Failed to initialize curl");
+                continue;
+            }
+            curl_multi_add_handle(multi_, transfer->handle());
+            running_.push_back(std::move(transfer));
+            hedge_at_ = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(static_cast<long>(hedgeDelay()));
+            return;
+        }
+        if (running_.empty()) {
+            endStage(std::move(failed_), false);
+        }
+    }
+
+    // Conclude the stage with its winning transfer, or with the last failed
+    // one when usable is false
+    void endStage(std::unique_ptr<FeedTransfer> transfer, bool usable) {
+        cancel();
+        auto outcome = feed_.conclude(stages_[stage_], transfer.get(), error_, revalidate_);
+        fresh_ = fresh_ || (usable && outcome.snapshot);
+        handle(outcome);
+    }
+
+    void handle(const SofaFeed::Outcome& outcome) {
+        if (outcome.retry) {
+            startStage(false);
+            return;
+        }
+        if (outcome.snapshot || !error_.empty()) {
+            finish(outcome.snapshot);
+            return;
+        }
+        // This source has nothing, move on to the next one
+        if (stage_ + 1 < stages_.size()) {
+            feed_.count(SofaFeed::kFallbacks);
+            VLOG(1) << "Nothing usable from " << stages_[stage_].label << ", trying "
+                    << stages_[stage_ + 1].label;
+        }
+        stage_++;
+        startStage(true);
+    }
+
+    void finish(std::shared_ptr<const SofaSnapshot> snapshot) {
+        done_ = true;
+        feed_.finishRefresh(std::move(snapshot), error_, bytes_, fresh_, failure_);
+    }
+
+    // Drop the requests in flight; how long they had been waiting is a lower
+    // bound on their latency
+    void cancel() {
+        for (auto& transfer : running_) {
+            curl_multi_remove_handle(multi_, transfer->handle());
+            bytes_ += transfer->wireBytes();
+            feed_.latency().recordCensored(transfer->url(), transfer->elapsedMs());
+        }
+        running_.clear();
+    }
+
+    SofaFeed& feed_;
+    CURLM* multi_;
+    std::vector<SofaFeed::Stage> stages_;
+    size_t stage_ = 0;
+    bool revalidate_ = true;
+    std::string etag_;
+    std::vector<std::string> order_;
+    size_t next_ = 0;
+    std::chrono::steady_clock::time_point hedge_at_;
+    std::chrono::steady_clock::time_point stage_deadline_;
+    std::vector<std::unique_ptr<FeedTransfer>> running_;
+    std::unique_ptr<FeedTransfer> failed_;
+    std::string error_;
+    // The last failed request, for macos_compatibility_health
+    std::string failure_;
+    uint64_t bytes_ = 0;
+    bool fresh_ = false;
+    bool done_ = false;
+};
+
+// The SOFA feeds the extension knows about
+enum class FeedId { kMacOS, kIOS };
+
+// Keeps every SOFA feed fresh from one background thread. All transfers run
+// on a single curl multi handle, so feeds refresh concurrently and queries
+// only ever read published snapshots: a query waits on the network only for
+// a feed's very first result, and only when there is no cache to start from.
+// Config section that carries a feed
+static const std::string& configKey(FeedId id) {
+    return id == FeedId::kMacOS ? kConfigMacOSFeedKey : kConfigIOSFeedKey;
+}
+
+class FeedEngine {
+ public:
+    static FeedEngine& instance() {
+        static FeedEngine engine;
+        return engine;
+    }
+
+    // The latest result of a feed. The first call for a feed starts keeping
+    // it fresh; the engine's first start also covers every feed in
+    // --macos_compatibility_feeds. model selects the mirror slice to prefer
+    // and may be empty.
+    std::shared_ptr<const SofaSnapshot> snapshot(FeedId id,
+                                                 const std::string& model,
+                                                 std::string& error) {
+        SofaFeed& feed = this->feed(id);
+        Slot& slot = slots_[static_cast<size_t>(id)];
+        // Queries only wake the engine when it has something to do: a feed
+        // to start keeping fresh, a new model to pick the slice for, or a
+        // refresh that is due
+        bool changed = !model.empty() && feed.setModel(model);
+        if (!slot.active) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable()) {
+                std::string feeds = "," + FLAGS_macos_compatibility_feeds + ",";
+                for (auto& other : slots_) {
+                    if (feeds.find("," + other.feed->spec().name + ",") != std::string::npos) {
+                        other.active = true;
+                    }
+                }
+                thread_ = std::thread([this] { run(); });
+            }
+            slot.active = true;
+            changed = true;
+        }
+        if (changed || feed.secondsToRefresh() == 0) {
+            wake();
+        }
+        feed.count(SofaFeed::kQueries);
+        return feed.result(kFirstResultWait, error);
+    }
+
+    // The feed as delivered in the osquery config. The first call starts
+    // reading the config every refresh interval instead of fetching feeds.
+    std::shared_ptr<const SofaSnapshot> configSnapshot(FeedId id, std::string& error) {
+        // The engine reads the config on its own schedule once it knows to
+        if (!config_active_.exchange(true)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable()) {
+                thread_ = std::thread([this] { run(); });
+            }
+            wake();
+        }
+        feed(id).count(SofaFeed::kQueries);
+        return ConfigFeeds::instance().get(configKey(id), kFirstResultWait, error);
+    }
+
+    SofaFeed& feed(FeedId id) { return *slots_[static_cast<size_t>(id)].feed; }
+
+    // Whether the engine keeps the feed fresh
+    bool active(FeedId id) const { return slots_[static_cast<size_t>(id)].active; }
+
+ private:
+    // How long a query waits for a feed's first result
+    static constexpr std::chrono::seconds kFirstResultWait{30};
+    // Retry delay after a refresh that reached no source, doubling per failure
+    static constexpr std::chrono::seconds kRetryDelay{30};
+    // Floor of --macos_compatibility_refresh_interval, in seconds
+    static constexpr uint64_t kMinInterval = 60;
+
+    struct Slot {
+        std::unique_ptr<SofaFeed> feed;
+        std::atomic<bool> active{false};
+        // Engine thread only
+        std::unique_ptr<RefreshJob> job;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    FeedEngine() {
+        // Initialize curl
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        multi_ = curl_multi_init();
+        auto wake = [this] { this->wake(); };
+        slots_[static_cast<size_t>(FeedId::kMacOS)].feed = std::make_unique<SofaFeed>(
+            FeedSpec{"macos", "macos_data_feed",
+                     [] { return splitUrls(FLAGS_macos_compatibility_feed_urls, kSofaUrl); },
+                     true},
+            writer_, wake);
+        slots_[static_cast<size_t>(FeedId::kIOS)].feed = std::make_unique<SofaFeed>(
+            FeedSpec{"ios", "ios_data_feed",
+                     [] { return splitUrls(FLAGS_macos_compatibility_ios_feed_urls, kSofaIOSUrl); },
+                     false},
+            writer_, wake);
+    }
+
+    // Everything that can call wake() or reach into the feeds stops before
+    // the multi handle goes: the engine thread, the cache watchers, whose
+    // callbacks wake the engine, and the cache writer, whose callbacks
+    // update the feeds
+    ~FeedEngine() {
+        stopping_ = true;
+        if (thread_.joinable()) {
+            wake();
+            thread_.join();
+        }
+        for (auto& slot : slots_) {
+            slot.feed->stopWatching();
+            slot.job.reset();
+        }
+        writer_.stop();
+        curl_multi_cleanup(multi_);
+        multi_ = nullptr;
+        // Clean up curl
+        curl_global_cleanup();
+    }
+
+    void wake() {
+        if (multi_) {
+            curl_multi_wakeup(multi_);
+        }
+    }
+
+    void run() {
+        using Clock = std::chrono::steady_clock;
+        auto last_summary = Clock::now();
+        while (!stopping_) {
+            auto now = Clock::now();
+            if (now - last_summary >= logInterval()) {
+                auto period = std::chrono::duration_cast<std::chrono::seconds>(now - last_summary);
+                for (auto& slot : slots_) {
+                    slot.feed->logSummary(period);
+                }
+                last_summary = now;
+            }
+            if (config_active_ && now >= config_due_) {
+                ConfigFeeds::instance().load();
+                config_due_ = now + refreshInterval();
+            }
+            for (auto& slot : slots_) {
+                if (!slot.active) {
+                    continue;
+                }
+                if (!slot.job) {
+                    slot.feed->syncIfRequested();
+                    if (now >= slot.due) {
+                        slot.feed->setNextRefresh(now);
+                        slot.job = std::make_unique<RefreshJob>(*slot.feed, multi_);
+                    }
+                }
+                if (slot.job) {
+                    slot.job->launchDue(now);
+                }
+                reap(slot);
+            }
+
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+            int queued = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi_, &queued)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                for (auto& slot : slots_) {
+                    if (slot.job && slot.job->owns(msg->easy_handle)) {
+                        slot.job->onDone(msg->easy_handle, msg->data.result);
+                        break;
+                    }
+                }
+            }
+
+            // Sleep until a transfer needs attention, a hedge, stage deadline,
+            // refresh or summary is due, or a query or the cache watcher wakes us
+            auto wake_at = std::min(Clock::now() + std::chrono::seconds(60),
+                                    last_summary + logInterval());
+            if (config_active_) {
+                wake_at = std::min(wake_at, config_due_);
+            }
+            for (auto& slot : slots_) {
+                reap(slot);
+                if (slot.job) {
+                    wake_at = std::min(wake_at, slot.job->nextDue());
+                } else if (slot.active) {
+                    wake_at = std::min(wake_at, slot.due);
+                }
+            }
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake_at -
+                                                                                 Clock::now());
+            curl_multi_poll(multi_, nullptr, 0, std::max(0, static_cast<int>(timeout.count())),
+                            nullptr);
+        }
+    }
+
+    std::chrono::seconds refreshInterval() const {
+        return std::chrono::seconds(
+            std::max<uint64_t>(FLAGS_macos_compatibility_refresh_interval, kMinInterval));
+    }
+
+    // Retire a finished job and schedule the feed's next refresh
+    void reap(Slot& slot) {
+        if (!slot.job || !slot.job->done()) {
+            return;
+        }
+        auto interval = refreshInterval();
+        if (!slot.job->fresh()) {
+            auto backoff = kRetryDelay * (1u << std::min(slot.feed->failures() - 1, 10u));
+            interval = std::min(interval,
+                                std::chrono::duration_cast<std::chrono::seconds>(backoff));
+        }
+        slot.due = std::chrono::steady_clock::now() + interval;
+        slot.feed->setNextRefresh(slot.due);
+        slot.job.reset();
+
+        // The transfer buffers are gone by now, return their pages to the OS
+        if (FLAGS_macos_compatibility_low_memory) {
+            releaseFreedMemory();
+        }
+    }
+
+    CURLM* multi_ = nullptr;
+    std::array<Slot, 2> slots_;
+    // Stopped by the destructor before the feeds go away
+    CacheWriter writer_;
+    std::mutex mutex_;
+    // Whether the engine reads feeds from the osquery config, and when next
+    std::atomic<bool> config_active_{false};
+    std::chrono::steady_clock::time_point config_due_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+// os_version and system_info answers for this host
+struct HostFacts {
+    std::string system_version;
+    std::string system_os_major;
+    std::string model_identifier;
+    FileIdentity identity;
+};
+
+// Host facts shared by the macOS tables
+class HostFactsCache {
+ public:
+    static HostFactsCache& instance() {
+        static HostFactsCache cache;
+        return cache;
+    }
+
+    // The host facts, queried again only when SystemVersion.plist changed.
+    // A new version is a new object, so the pointer identifies it.
+    std::shared_ptr<const HostFacts> get() {
+        auto identity = FileIdentity::of(kSystemVersionPlist);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (facts_ && identity.exists() && identity == facts_->identity) {
+            return facts_;
+        }
+
+        // Get system version from os_version table
+        auto os_data = SQL::selectAllFrom("os_version");
+        if (os_data.empty()) {
+            SOFA_LOG_LIMITED(ERROR, "os_version", "Failed to get os_version data");
+            return nullptr;
+        }
+        auto facts = std::make_shared<HostFacts>();
+        facts->system_version = os_data.front().at("product_version");
+
+        // Extract major OS version (e.g., 14 from 14.5)
+        facts->system_os_major = facts->system_version.substr(0, facts->system_version.find("."));
+
+        // Get model identifier from system_info table
+        auto sys_data = SQL::selectAllFrom("system_info");
+        if (sys_data.empty()) {
+            SOFA_LOG_LIMITED(ERROR, "system_info", "Failed to get system_info data");
+            return nullptr;
+        }
+        facts->model_identifier = sys_data.front().at("hardware_model");
+        facts->identity = identity;
+        facts_ = facts;
+        return facts_;
+    }
+
+ private:
+    // Every OS update replaces SystemVersion.plist, so its stat() identity
+    // versions the host facts
+    static constexpr const char* kSystemVersionPlist =
+        "/System/Library/CoreServices/SystemVersion.plist";
 
-using json = nlohmann::json;
+    std::mutex mutex_;
+    std::shared_ptr<const HostFacts> facts_;
+};
 
-namespace osquery {
+// Installed bundle versions by Info.plist path, read in one query. A plist
+// that is missing or has no version is left out.
+using BundleVersions = std::map<std::string, std::string, std::less<>>;
 
-// Callback function for curl
-static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* userp) {
-    userp->append((char*)contents, size * nmemb);
-    return size * nmemb;
+static BundleVersions readBundleVersions(const std::vector<std::string>& plists) {
+    std::string query =
+        "SELECT path, value FROM plist WHERE key = 'CFBundleShortVersionString' AND path IN (";
+    for (const auto& plist : plists) {
+        query += (&plist == &plists.front() ? "'" : ", '") + plist + "'";
+    }
+    query += ")";
+
+    BundleVersions versions;
+    SQL sql(query);
+    if (!sql.ok()) {
+        SOFA_LOG_LIMITED(ERROR, "bundle plist",
+                         "Failed to read bundle versions: " << sql.getMessageString());
+        return versions;
+    }
+    for (const auto& row : sql.rows()) {
+        versions[row.at("path")] = row.at("value");
+    }
+    return versions;
 }
 
-class MacOSCompatibilityTable : public TablePlugin {
- private:
-    // Cache directory
-    const std::string kCacheDir = "/private/var/tmp/sofa";
-    const std::string kJsonCache = kCacheDir + "/macos_data_feed.json";
-    const std::string kEtagCache = kCacheDir + "/macos_data_feed_etag.txt";
+// Feed sources are compile-time policies of the compatibility tables, so
+// every source runs the same evaluation code without a virtual call. A
+// source provides, as static members:
+//   snapshot(id, model, error)  the current snapshot, as FeedEngine::snapshot
+//   downloadBytes(id)           wire bytes of the last refresh
+//   downloadBytesTotal(id)      and over the process lifetime
+//   hostFacts()                 the host's version and model, or nullptr
+//   bundleVersions(plists)      installed versions, as readBundleVersions
+// Tests and benchmarks can plug in an in-memory source with the same shape,
+// as tests/macos_compatibility_test.cpp does.
+
+// The feed engine: network, mirror and file cache; sofa_mirror --replay
+// stands in for the network when its URL is configured
+struct EngineSource {
+    static std::shared_ptr<const SofaSnapshot> snapshot(FeedId id,
+                                                        const std::string& model,
+                                                        std::string& error) {
+        return FeedEngine::instance().snapshot(id, model, error);
+    }
+
+    static uint64_t downloadBytes(FeedId id) {
+        return FeedEngine::instance().feed(id).downloadBytes();
+    }
+
+    static uint64_t downloadBytesTotal(FeedId id) {
+        return FeedEngine::instance().feed(id).downloadBytesTotal();
+    }
+
+    static std::shared_ptr<const HostFacts> hostFacts() { return HostFactsCache::instance().get(); }
+
+    static BundleVersions bundleVersions(const std::vector<std::string>& plists) {
+        return readBundleVersions(plists);
+    }
+};
+
+// Feeds delivered in the osquery config; nothing is fetched
+struct ConfigSource {
+    static std::shared_ptr<const SofaSnapshot> snapshot(FeedId id,
+                                                        const std::string&,
+                                                        std::string& error) {
+        return FeedEngine::instance().configSnapshot(id, error);
+    }
+
+    static uint64_t downloadBytes(FeedId) { return 0; }
+    static uint64_t downloadBytesTotal(FeedId) { return 0; }
+
+    static std::shared_ptr<const HostFacts> hostFacts() { return HostFactsCache::instance().get(); }
+
+    static BundleVersions bundleVersions(const std::vector<std::string>& plists) {
+        return readBundleVersions(plists);
+    }
+};
+
+// What production builds use: --macos_compatibility_feed_source picks the
+// config or the engine at run time
+struct FlagSource {
+    static bool fromConfig() { return FLAGS_macos_compatibility_feed_source == "config"; }
+
+    static std::shared_ptr<const SofaSnapshot> snapshot(FeedId id,
+                                                        const std::string& model,
+                                                        std::string& error) {
+        return fromConfig() ? ConfigSource::snapshot(id, model, error)
+                            : EngineSource::snapshot(id, model, error);
+    }
+
+    static uint64_t downloadBytes(FeedId id) {
+        return fromConfig() ? ConfigSource::downloadBytes(id) : EngineSource::downloadBytes(id);
+    }
+
+    static uint64_t downloadBytesTotal(FeedId id) {
+        return fromConfig() ? ConfigSource::downloadBytesTotal(id)
+                            : EngineSource::downloadBytesTotal(id);
+    }
+
+    // Both sources read the host facts from osquery's tables
+    static std::shared_ptr<const HostFacts> hostFacts() { return EngineSource::hostFacts(); }
+
+    static BundleVersions bundleVersions(const std::vector<std::string>& plists) {
+        return EngineSource::bundleVersions(plists);
+    }
+};
 
-    // SOFA feed URL
-    const std::string kSofaUrl = "https://sofafeed.macadmins.io/v1/macos_data_feed.json";
-    const std::string kUserAgent = "SOFA-osquery-macOSCompatibilityCheck/1.0";
+// Use M1 Mac mini as reference for VMs
+static std::string referenceModel(const std::string& model_identifier) {
+    if (model_identifier.find("VirtualMac") != std::string::npos) {
+        return "Macmini9,1";
+    }
+    return model_identifier;
+}
 
+template <typename Source>
+class BasicMacOSCompatibilityTable : public TablePlugin {
+ private:
     TableColumns columns() const {
         return {
             std::make_tuple("system_version", TEXT_TYPE, ColumnOptions::DEFAULT),
@@ -40,221 +2578,550 @@ class MacOSCompatibilityTable : public TablePlugin {
             std::make_tuple("latest_compatible_macos", TEXT_TYPE, ColumnOptions::DEFAULT),
             std::make_tuple("is_compatible", INTEGER_TYPE, ColumnOptions::DEFAULT),
             std::make_tuple("status", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("rss_bytes", BIGINT_TYPE, ColumnOptions::HIDDEN),
+            std::make_tuple("peak_rss_bytes", BIGINT_TYPE, ColumnOptions::HIDDEN),
+            std::make_tuple("cpu_time_ms", BIGINT_TYPE, ColumnOptions::HIDDEN),
+            std::make_tuple("download_bytes", BIGINT_TYPE, ColumnOptions::HIDDEN),
+            std::make_tuple("download_bytes_total", BIGINT_TYPE, ColumnOptions::HIDDEN),
         };
     }
 
-    // Create cache directory if it doesn't exist
-    bool ensureCacheDir() {
-        try {
-            if (access(kCacheDir.c_str(), F_OK) != 0) {
-                if (mkdir(kCacheDir.c_str(), 0755) != 0) {
-                    LOG(ERROR) << "Failed to create cache directory: " << kCacheDir;
-                    return false;
-                }
-            }
-            return true;
-        } catch (const std::exception& e) {
-            LOG(ERROR) << "Exception creating cache directory: " << e.what();
-            return false;
+    // Copy a rendered row into the results
+    void emit(const Row& row, TableRows& results) {
+        auto r = make_table_row();
+        for (const auto& [column, value] : row) {
+            r[column] = value;
         }
+        results.push_back(std::move(r));
     }
 
-    // Read file content
-    std::string readFile(const std::string& filename) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            return "";
+    // Fill the hidden resource columns so the footprint can be watched from
+    // SQL. They describe this call, so memoized rows get them afresh.
+    void addResourceUsage(TableRows& results) {
+        auto usage = getResourceUsage();
+        for (auto& row : results) {
+            auto& r = static_cast<DynamicTableRow&>(*row);
+            r["rss_bytes"] = std::to_string(usage.rss_bytes);
+            r["peak_rss_bytes"] = std::to_string(usage.peak_rss_bytes);
+            r["cpu_time_ms"] = std::to_string(usage.cpu_time_ms);
+            r["download_bytes"] = std::to_string(Source::downloadBytes(FeedId::kMacOS));
+            r["download_bytes_total"] =
+                std::to_string(Source::downloadBytesTotal(FeedId::kMacOS));
         }
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        return buffer.str();
     }
 
-    // Write content to file
-    bool writeFile(const std::string& filename, const std::string& content) {
-        std::ofstream file(filename);
-        if (!file.is_open()) {
-            return false;
-        }
-        file << content;
-        return true;
+    // Guards the memoized row
+    std::mutex mutex_;
+
+    // The row last rendered from a snapshot and its inputs. Holding both
+    // pointers keeps them from being reused by a later snapshot or facts.
+    // The table is not declared CACHEABLE: osquery's cache would replay the
+    // resource columns of the query that filled it.
+    std::shared_ptr<const SofaSnapshot> memo_snapshot_;
+    std::shared_ptr<const HostFacts> memo_facts_;
+    Row memo_row_;
+    // Rows rendered from a snapshot rather than the memo
+    uint64_t renders_ = 0;
+
+ public:
+    uint64_t renders() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return renders_;
     }
 
-    // Fetch SOFA json data with etag handling
-    std::string fetchSofaJson() {
-        if (!ensureCacheDir()) {
-            return "";
-        }
+    TableRows generate(QueryContext& context) {
+        TableRows results;
 
-        CURL* curl = curl_easy_init();
-        if (!curl) {
-            LOG(ERROR) << "Failed to initialize curl";
-            return "";
+        auto facts = Source::hostFacts();
+        if (!facts) {
+            return results;
         }
+        std::string model_identifier = facts->model_identifier;
 
-        CURLcode res;
-        std::string readBuffer;
-        struct curl_slist* headers = NULL;
+        // The feed engine keeps the snapshot fresh in the background
+        std::string error;
+        auto snapshot = Source::snapshot(FeedId::kMacOS, referenceModel(model_identifier), error);
 
-        // If we have a cached etag, use it
-        std::string etag = readFile(kEtagCache);
-        if (!etag.empty()) {
-            std::string header = "If-None-Match: " + etag;
-            headers = curl_slist_append(headers, header.c_str());
+        if (!snapshot && error.empty()) {
+            auto r = make_table_row();
+            r["system_version"] = facts->system_version;
+            r["system_os_major"] = facts->system_os_major;
+            r["model_identifier"] = model_identifier;
+            r["latest_macos"] = "Unknown";
+            r["latest_compatible_macos"] = "Unknown";
+            r["is_compatible"] = "-1"; // Error code
+            r["status"] = "Could not obtain data";
+            results.push_back(std::move(r));
+            addResourceUsage(results);
+            return results;
         }
 
-        curl_easy_setopt(curl, CURLOPT_URL, kSofaUrl.c_str());
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, kUserAgent.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        
-        res = curl_easy_perform(curl);
-        
-        if (res != CURLE_OK) {
-            LOG(ERROR) << "curl_easy_perform() failed: " << curl_easy_strerror(res);
-            curl_easy_cleanup(curl);
-            return "";
+        if (!snapshot) {
+            SOFA_LOG_LIMITED(ERROR, "macos query", "Error parsing SOFA data: " << error);
+            
+            auto r = make_table_row();
+            r["system_version"] = facts->system_version;
+            r["system_os_major"] = facts->system_os_major;
+            r["model_identifier"] = model_identifier;
+            r["latest_macos"] = "Error";
+            r["latest_compatible_macos"] = "Error";
+            r["is_compatible"] = "-1"; // Error code
+            r["status"] = "Error parsing data: " + error;
+            results.push_back(std::move(r));
+            addResourceUsage(results);
+            return results;
         }
 
-        long http_code = 0;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-
-        // Check for etag in response
-        char* new_etag = nullptr;
-        res = curl_easy_getinfo(curl, CURLINFO_ETAG, &new_etag);
-        if (res == CURLE_OK && new_etag) {
-            writeFile(kEtagCache, new_etag);
+        // Same snapshot and host facts as last time: the row is the same too
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (snapshot == memo_snapshot_ && facts == memo_facts_) {
+            emit(memo_row_, results);
+            addResourceUsage(results);
+            return results;
         }
-
-        curl_easy_cleanup(curl);
         
-        // If we got 304 Not Modified, use cached json
-        if (http_code == 304) {
-            LOG(INFO) << "Using cached SOFA json (304 Not Modified)";
-            return readFile(kJsonCache);
-        }
+        std::string latest_os(snapshot->latestOs());
+        std::string latest_compatible_os = "Unsupported";
+        std::string status = "Pass";
         
-        // If we got new data, cache it
-        if (http_code == 200) {
-            writeFile(kJsonCache, readBuffer);
-            return readBuffer;
+        // Virtual machines are checked against their reference model
+        model_identifier = referenceModel(model_identifier);
+        
+        // Check if model exists in the feed
+        auto supported_os = snapshot->supportedOs(model_identifier);
+        if (!supported_os.empty()) {
+            latest_compatible_os = std::string(supported_os.front());
+        } else {
+            status = "Unsupported Hardware";
         }
         
-        // If we couldn't get new data but have cached data, use it
-        if (!readFile(kJsonCache).empty()) {
-            LOG(WARNING) << "Failed to fetch new data (HTTP " << http_code << "), using cached data";
-            return readFile(kJsonCache);
+        bool is_compatible = (latest_os == latest_compatible_os);
+        if (!is_compatible && status != "Unsupported Hardware") {
+            status = "Fail";
         }
         
-        LOG(ERROR) << "Failed to fetch SOFA data (HTTP " << http_code << ") and no cache available";
-        return "";
-    }
+        Row row;
+        renders_++;
+        row["system_version"] = facts->system_version;
+        row["system_os_major"] = facts->system_os_major;
+        row["model_identifier"] = model_identifier;
+        row["latest_macos"] = latest_os;
+        row["latest_compatible_macos"] = latest_compatible_os;
+        row["is_compatible"] = is_compatible ? "1" : "0";
+        row["status"] = status;
+        emit(row, results);
 
- public:
-    MacOSCompatibilityTable() {
-        // Initialize curl
-        curl_global_init(CURL_GLOBAL_DEFAULT);
+        memo_snapshot_ = std::move(snapshot);
+        memo_facts_ = std::move(facts);
+        memo_row_ = std::move(row);
+        addResourceUsage(results);
+        return results;
     }
+};
 
-    ~MacOSCompatibilityTable() {
-        // Clean up curl
-        curl_global_cleanup();
+using MacOSCompatibilityTable = BasicMacOSCompatibilityTable<FlagSource>;
+
+REGISTER_OSQUERY_TABLE(MacOSCompatibilityTable);
+
+// Every macOS release this host could move to: the latest build of each
+// OS its model supports that is newer than the running version, with the
+// CVEs fixed since that version
+//   SELECT target_os, target_version, cve_count FROM macos_upgrade_options;
+// The per-model release lists are resolved when a snapshot is built, so a
+// query only walks the model's slice of the release index.
+template <typename Source>
+class BasicMacOSUpgradeOptionsTable : public TablePlugin {
+ private:
+    TableColumns columns() const {
+        return {
+            std::make_tuple("system_version", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("model_identifier", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("target_os", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("target_version", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("release_date", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("is_major_upgrade", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("is_latest", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("cve_count", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("exploited_cve_count", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("status", TEXT_TYPE, ColumnOptions::DEFAULT),
+        };
     }
 
+ public:
     TableRows generate(QueryContext& context) {
         TableRows results;
 
-        // Get system version from os_version table
-        auto os_data = SQL::selectAllFrom("os_version");
-        if (os_data.empty()) {
-            LOG(ERROR) << "Failed to get os_version data";
+        auto facts = Source::hostFacts();
+        if (!facts) {
             return results;
         }
-        std::string system_version = os_data.front().at("product_version");
-        
-        // Extract major OS version (e.g., 14 from 14.5)
-        std::string system_os_major = system_version.substr(0, system_version.find("."));
-                
-        // Get model identifier from system_info table
-        auto sys_data = SQL::selectAllFrom("system_info");
-        if (sys_data.empty()) {
-            LOG(ERROR) << "Failed to get system_info data";
+        std::string model_identifier = referenceModel(facts->model_identifier);
+
+        std::string error;
+        auto snapshot = Source::snapshot(FeedId::kMacOS, model_identifier, error);
+        if (!snapshot) {
+            if (!error.empty()) {
+                SOFA_LOG_LIMITED(ERROR, "upgrade query", "Error parsing SOFA data: " << error);
+            }
+            auto r = make_table_row();
+            r["system_version"] = facts->system_version;
+            r["model_identifier"] = model_identifier;
+            r["is_major_upgrade"] = "-1"; // Error code
+            r["is_latest"] = "-1";
+            r["cve_count"] = "-1";
+            r["exploited_cve_count"] = "-1";
+            r["status"] = error.empty() ? "Could not obtain data" : "Error parsing data: " + error;
+            results.push_back(std::move(r));
             return results;
         }
-        std::string model_identifier = sys_data.front().at("hardware_model");
-        
-        // Fetch and parse SOFA data
-        std::string jsonData = fetchSofaJson();
-        
-        if (jsonData.empty()) {
+
+        uint32_t installed = packVersion(facts->system_version);
+        for (const auto* release : snapshot->supportedReleases(model_identifier)) {
+            if (release->version.empty() || release->packed <= installed) {
+                continue;
+            }
+            auto cves = snapshot->cvesSince(*release, installed);
             auto r = make_table_row();
-            r["system_version"] = system_version;
-            r["system_os_major"] = system_os_major;
+            r["system_version"] = facts->system_version;
             r["model_identifier"] = model_identifier;
-            r["latest_macos"] = "Unknown";
-            r["latest_compatible_macos"] = "Unknown";
-            r["is_compatible"] = "-1"; // Error code
-            r["status"] = "Could not obtain data";
+            r["target_os"] = std::string(release->os);
+            r["target_version"] = std::string(release->version);
+            r["release_date"] = std::string(release->date);
+            r["is_major_upgrade"] = (release->packed >> 20) > (installed >> 20) ? "1" : "0";
+            r["is_latest"] = release->os == snapshot->latestOs() ? "1" : "0";
+            r["cve_count"] = std::to_string(cves.cves);
+            r["exploited_cve_count"] = std::to_string(cves.exploited);
+            r["status"] = "Available";
+            results.push_back(std::move(r));
+        }
+        return results;
+    }
+};
+
+using MacOSUpgradeOptionsTable = BasicMacOSUpgradeOptionsTable<FlagSource>;
+
+REGISTER_OSQUERY_TABLE(MacOSUpgradeOptionsTable);
+
+// Installed XProtect components against the versions the macOS feed
+// announces. The feed values come from the snapshot the other tables use;
+// the host's versions come from their bundles' Info.plist in one query.
+template <typename Source>
+class BasicXProtectFreshnessTable : public TablePlugin {
+ private:
+    TableColumns columns() const {
+        return {
+            std::make_tuple("component", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("section", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("path", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("installed_version", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("feed_version", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("release_date", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("is_current", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("status", TEXT_TYPE, ColumnOptions::DEFAULT),
+        };
+    }
+
+    // Where each feed component is installed
+    struct Bundle {
+        std::string_view component;
+        std::string_view path;
+    };
+
+    static constexpr Bundle kBundles[] = {
+        {"com.apple.XProtectFramework.XProtect",
+         "/Library/Apple/System/Library/CoreServices/XProtect.app/Contents/Info.plist"},
+        {"com.apple.XprotectFramework.PluginService",
+         "/Library/Apple/System/Library/CoreServices/XProtect.app/Contents/XPCServices/"
+         "XProtectPluginService.xpc/Contents/Info.plist"},
+        {"com.apple.XProtect",
+         "/Library/Apple/System/Library/CoreServices/XProtect.bundle/Contents/Info.plist"},
+    };
+
+    static std::string_view bundlePath(std::string_view component) {
+        for (const auto& bundle : kBundles) {
+            if (bundle.component == component) {
+                return bundle.path;
+            }
+        }
+        return {};
+    }
+
+    // Installed bundle versions by Info.plist path
+    static BundleVersions installedVersions() {
+        std::vector<std::string> plists;
+        for (const auto& bundle : kBundles) {
+            plists.emplace_back(bundle.path);
+        }
+        return Source::bundleVersions(plists);
+    }
+
+    // Compare dot-separated numeric versions; XProtect versions are build
+    // numbers like 5297, too large for packVersion()
+    static bool atLeast(std::string_view installed, std::string_view required) {
+        auto next = [](std::string_view& version) {
+            size_t dot = version.find('.');
+            auto part = std::string(version.substr(0, dot));
+            version = dot == std::string_view::npos ? std::string_view() : version.substr(dot + 1);
+            return std::strtoull(part.c_str(), nullptr, 10);
+        };
+        while (!installed.empty() || !required.empty()) {
+            auto have = next(installed);
+            auto want = next(required);
+            if (have != want) {
+                return have > want;
+            }
+        }
+        return true;
+    }
+
+ public:
+    TableRows generate(QueryContext& context) {
+        TableRows results;
+
+        std::string error;
+        auto snapshot = Source::snapshot(FeedId::kMacOS, "", error);
+        if (!snapshot) {
+            if (!error.empty()) {
+                SOFA_LOG_LIMITED(ERROR, "xprotect query", "Error parsing SOFA data: " << error);
+            }
+            auto r = make_table_row();
+            r["is_current"] = "-1"; // Error code
+            r["status"] = error.empty() ? "Could not obtain data" : "Error parsing data: " + error;
             results.push_back(std::move(r));
             return results;
         }
-        
-        try {
-            json j = json::parse(jsonData);
-            
-            std::string latest_os = j["OSVersions"][0]["OSVersion"];
+
+        auto installed = installedVersions();
+        for (const auto& component : snapshot->xprotect()) {
+            std::string_view path = bundlePath(component.identifier);
+            auto version = installed.find(path);
+            std::string is_current = "-1";
+            std::string status = "Unknown Component";
+            if (path.empty()) {
+                // Nothing to compare with
+            } else if (version == installed.end()) {
+                status = "Not Installed";
+            } else if (atLeast(version->second, component.version)) {
+                is_current = "1";
+                status = "Current";
+            } else {
+                is_current = "0";
+                status = "Outdated";
+            }
+
+            auto r = make_table_row();
+            r["component"] = std::string(component.identifier);
+            r["section"] = std::string(component.section);
+            r["path"] = std::string(path);
+            r["installed_version"] = version != installed.end() ? version->second : "";
+            r["feed_version"] = std::string(component.version);
+            r["release_date"] = std::string(component.date);
+            r["is_current"] = is_current;
+            r["status"] = status;
+            results.push_back(std::move(r));
+        }
+        return results;
+    }
+};
+
+using XProtectFreshnessTable = BasicXProtectFreshnessTable<FlagSource>;
+
+REGISTER_OSQUERY_TABLE(XProtectFreshnessTable);
+
+// Scores iOS/iPadOS devices against the iOS feed. product_type and
+// product_version are pushed down, so a device list can be joined in:
+//   SELECT * FROM ios_compatibility
+//     WHERE product_type = 'iPhone14,2' AND product_version = '17.6.1';
+// Without a product_type constraint every device in the feed is listed.
+template <typename Source>
+class BasicIOSCompatibilityTable : public TablePlugin {
+ private:
+    TableColumns columns() const {
+        return {
+            std::make_tuple("product_type", TEXT_TYPE, ColumnOptions::INDEX),
+            std::make_tuple("product_version", TEXT_TYPE, ColumnOptions::ADDITIONAL),
+            std::make_tuple("latest_ios", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("latest_version", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("latest_compatible_ios", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("latest_compatible_version", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("is_compatible", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("is_up_to_date", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("status", TEXT_TYPE, ColumnOptions::DEFAULT),
+        };
+    }
+
+    static std::string releaseVersion(const SofaSnapshot::Release* release) {
+        return release != nullptr ? std::string(release->version) : "";
+    }
+
+ public:
+    TableRows generate(QueryContext& context) {
+        TableRows results;
+
+        auto versions = context.constraints["product_version"].getAll(EQUALS);
+        if (versions.empty()) {
+            versions.insert("");
+        }
+
+        std::string error;
+        auto snapshot = Source::snapshot(FeedId::kIOS, "", error);
+        if (!snapshot) {
+            if (!error.empty()) {
+                SOFA_LOG_LIMITED(ERROR, "ios query", "Error parsing SOFA iOS data: " << error);
+            }
+            auto types = context.constraints["product_type"].getAll(EQUALS);
+            if (types.empty()) {
+                types.insert("");
+            }
+            std::string value = error.empty() ? "Unknown" : "Error";
+            for (const auto& type : types) {
+                for (const auto& version : versions) {
+                    auto r = make_table_row();
+                    r["product_type"] = type;
+                    r["product_version"] = version;
+                    r["latest_ios"] = value;
+                    r["latest_version"] = value;
+                    r["latest_compatible_ios"] = value;
+                    r["latest_compatible_version"] = value;
+                    r["is_compatible"] = "-1"; // Error code
+                    r["is_up_to_date"] = "-1";
+                    r["status"] = error.empty() ? "Could not obtain data"
+                                                : "Error parsing data: " + error;
+                    results.push_back(std::move(r));
+                }
+            }
+            return results;
+        }
+
+        std::set<std::string> types;
+        if (context.hasConstraint("product_type", EQUALS)) {
+            types = context.constraints["product_type"].getAll(EQUALS);
+        } else {
+            for (auto identifier : snapshot->modelIdentifiers()) {
+                types.emplace(identifier);
+            }
+        }
+
+        std::string_view latest_os = snapshot->latestOs();
+        std::string latest_version = releaseVersion(snapshot->release(latest_os));
+        for (const auto& type : types) {
+            auto supported_os = snapshot->supportedOs(type);
+            const SofaSnapshot::Release* compatible = nullptr;
             std::string latest_compatible_os = "Unsupported";
             std::string status = "Pass";
-            
-            // Check if model is virtual
-            if (model_identifier.find("VirtualMac") != std::string::npos) {
-                model_identifier = "Macmini9,1"; // Use M1 Mac mini as reference for VMs
-            }
-            
-            // Check if model exists in the feed
-            if (j["Models"].contains(model_identifier) && 
-                !j["Models"][model_identifier]["SupportedOS"].empty()) {
-                latest_compatible_os = j["Models"][model_identifier]["SupportedOS"][0];
+            if (!supported_os.empty()) {
+                latest_compatible_os = std::string(supported_os.front());
+                compatible = snapshot->release(supported_os.front());
             } else {
                 status = "Unsupported Hardware";
             }
-            
+
             bool is_compatible = (latest_os == latest_compatible_os);
             if (!is_compatible && status != "Unsupported Hardware") {
                 status = "Fail";
             }
-            
-            auto r = make_table_row();
-            r["system_version"] = system_version;
-            r["system_os_major"] = system_os_major;
-            r["model_identifier"] = model_identifier;
-            r["latest_macos"] = latest_os;
-            r["latest_compatible_macos"] = latest_compatible_os;
-            r["is_compatible"] = is_compatible ? "1" : "0";
-            r["status"] = status;
-            
-            results.push_back(std::move(r));
-            
-        } catch (const std::exception& e) {
-            LOG(ERROR) << "Exception parsing SOFA data: " << e.what();
-            
+
+            for (const auto& version : versions) {
+                // Up to date means at least the newest build the device can run
+                std::string is_up_to_date = "-1";
+                if (!version.empty() && compatible != nullptr && !compatible->version.empty()) {
+                    is_up_to_date = packVersion(version) >= compatible->packed ? "1" : "0";
+                }
+
+                auto r = make_table_row();
+                r["product_type"] = type;
+                r["product_version"] = version;
+                r["latest_ios"] = std::string(latest_os);
+                r["latest_version"] = latest_version;
+                r["latest_compatible_ios"] = latest_compatible_os;
+                r["latest_compatible_version"] = releaseVersion(compatible);
+                r["is_compatible"] = is_compatible ? "1" : "0";
+                r["is_up_to_date"] = is_up_to_date;
+                r["status"] = status;
+                results.push_back(std::move(r));
+            }
+        }
+        return results;
+    }
+};
+
+using IOSCompatibilityTable = BasicIOSCompatibilityTable<FlagSource>;
+
+REGISTER_OSQUERY_TABLE(IOSCompatibilityTable);
+
+// Readiness of the extension on this host, one row per feed. It answers
+// from in-memory state only and never starts a refresh, so fleet-wide
+// health checks add no load:
+//   SELECT feed, loaded, snapshot_age_seconds, failures, last_error
+//     FROM macos_compatibility_health;
+class MacOSCompatibilityHealthTable : public TablePlugin {
+ private:
+    TableColumns columns() const {
+        return {
+            std::make_tuple("feed", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("source", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("source_url", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("feed_source", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("mirror_url", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("active", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("loaded", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("snapshot_age_seconds", BIGINT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("last_refresh_time", BIGINT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("last_success_time", BIGINT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("last_error", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("failures", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("next_refresh_seconds", BIGINT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("cache_file", TEXT_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("cache_verified", INTEGER_TYPE, ColumnOptions::DEFAULT),
+            std::make_tuple("quarantined_caches", BIGINT_TYPE, ColumnOptions::DEFAULT),
+        };
+    }
+
+ public:
+    TableRows generate(QueryContext& context) {
+        TableRows results;
+        auto& engine = FeedEngine::instance();
+        bool from_config = FLAGS_macos_compatibility_feed_source == "config";
+        int64_t now = std::time(nullptr);
+
+        for (FeedId id : {FeedId::kMacOS, FeedId::kIOS}) {
+            const SofaFeed& feed = engine.feed(id);
+            auto health = feed.health();
+            bool active = !from_config && engine.active(id);
+
             auto r = make_table_row();
-            r["system_version"] = system_version;
-            r["system_os_major"] = system_os_major;
-            r["model_identifier"] = model_identifier;
-            r["latest_macos"] = "Error";
-            r["latest_compatible_macos"] = "Error";
-            r["is_compatible"] = "-1"; // Error code
-            r["status"] = "Error parsing data: " + std::string(e.what());
-            
+            r["feed"] = feed.spec().name;
+            // With a config-delivered feed the engine does not run and only
+            // loaded and source are meaningful
+            if (from_config) {
+                health.loaded = ConfigFeeds::instance().get(configKey(id)) != nullptr;
+                health.source = health.loaded ? "config" : "";
+                health.source_url.clear();
+            }
+            r["source"] = health.source;
+            r["source_url"] = health.source_url;
+            // The flags the sources are chosen by
+            r["feed_source"] = FLAGS_macos_compatibility_feed_source;
+            r["mirror_url"] = feed.spec().mirrored ? FLAGS_macos_compatibility_mirror_url : "";
+            r["active"] = active ? "1" : "0";
+            r["loaded"] = health.loaded ? "1" : "0";
+            r["snapshot_age_seconds"] = health.loaded && health.fetched_time > 0
+                                            ? std::to_string(now - health.fetched_time)
+                                            : "-1";
+            r["last_refresh_time"] = std::to_string(health.refresh_time);
+            r["last_success_time"] = std::to_string(health.success_time);
+            r["last_error"] = health.error;
+            r["failures"] = std::to_string(health.failures);
+            r["next_refresh_seconds"] = active ? std::to_string(feed.secondsToRefresh()) : "-1";
+            r["cache_file"] = health.cache_file;
+            r["cache_verified"] = health.cache_verified ? "1" : "0";
+            r["quarantined_caches"] = std::to_string(health.quarantined);
             results.push_back(std::move(r));
         }
-        
         return results;
     }
 };
 
-REGISTER_OSQUERY_TABLE(MacOSCompatibilityTable);
+REGISTER_OSQUERY_TABLE(MacOSCompatibilityHealthTable);
 
-} // namespace osquery
\ No newline at end of file
+} // namespace osquery
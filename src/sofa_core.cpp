@@ -0,0 +1,1008 @@
+#include "sofa_core.h"
+
+#include <nlohmann/json.hpp>
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+#include <simdjson.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+using json = nlohmann::json;
+
+namespace osquery {
+
+// Collects what the feed says about each OSVersions[i] release: its OS name,
+// the ProductVersion and ReleaseDate of its latest build, its
+// SecurityReleases and, for feeds without a Models map, the devices in
+// Latest.SupportedDevices. Fields may arrive in any order, so nothing is
+// added to the snapshot until build().
+class FeedReleases {
+ public:
+    void setOsName(size_t release, std::string_view name) { at(release).name = name; }
+
+    void setVersion(size_t release, std::string_view version) {
+        at(release).version = version;
+    }
+
+    void setDate(size_t release, std::string_view date) { at(release).date = date; }
+
+    void setSecurityVersion(size_t release, size_t update, std::string_view version) {
+        at(release, update).version = version;
+    }
+
+    void setSecurityDate(size_t release, size_t update, std::string_view date) {
+        at(release, update).date = date;
+    }
+
+    void setSecurityCves(size_t release, size_t update, uint32_t cves) {
+        at(release, update).cves = cves;
+    }
+
+    void addExploitedCve(size_t release, size_t update) { at(release, update).exploited++; }
+
+    void addDevice(size_t release, std::string_view device) {
+        auto it = devices_.find(device);
+        if (it == devices_.end()) {
+            it = devices_.emplace(std::string(device), std::vector<size_t>()).first;
+        }
+        it->second.push_back(release);
+    }
+
+    bool hasDevices() const { return !devices_.empty(); }
+
+    // Add the release table and, when with_devices is set, per-device OS
+    // lists newest release first like the feed
+    void build(SofaSnapshot& snapshot, bool with_devices) const {
+        size_t security_releases = 0;
+        for (const auto& release : releases_) {
+            security_releases += release.security.size();
+        }
+        snapshot.reserveReleases(releases_.size(), security_releases);
+        for (const auto& release : releases_) {
+            if (release.name.empty()) {
+                continue;
+            }
+            snapshot.addRelease(release.name, release.version, release.date);
+            for (const auto& update : release.security) {
+                snapshot.addSecurityRelease(update.version, update.date, update.cves,
+                                            update.exploited);
+            }
+        }
+        if (!with_devices) {
+            return;
+        }
+        for (const auto& [device, releases] : devices_) {
+            snapshot.beginModel(device);
+            std::vector<size_t> sorted(releases);
+            std::sort(sorted.begin(), sorted.end());
+            sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+            for (size_t release : sorted) {
+                if (release < releases_.size() && !releases_[release].name.empty()) {
+                    snapshot.addSupportedOs(releases_[release].name);
+                }
+            }
+        }
+    }
+
+ private:
+    struct SecurityRelease {
+        std::string version;
+        std::string date;
+        uint32_t cves = 0;
+        uint32_t exploited = 0;
+    };
+
+    struct Release {
+        std::string name;
+        std::string version;
+        std::string date;
+        std::vector<SecurityRelease> security;
+    };
+
+    Release& at(size_t release) {
+        if (releases_.size() <= release) {
+            releases_.resize(release + 1);
+        }
+        return releases_[release];
+    }
+
+    SecurityRelease& at(size_t release, size_t update) {
+        auto& security = at(release).security;
+        if (security.size() <= update) {
+            security.resize(update + 1);
+        }
+        return security[update];
+    }
+
+    std::vector<Release> releases_;
+    std::map<std::string, std::vector<size_t>, std::less<>> devices_;
+};
+
+// Collects the XProtectPayloads and XProtectPlistConfigData sections. Each
+// holds component versions keyed by bundle identifier plus one ReleaseDate,
+// which may come before or after the versions.
+class FeedXProtect {
+ public:
+    static bool isSection(std::string_view key) {
+        return key == "XProtectPayloads" || key == "XProtectPlistConfigData";
+    }
+
+    void set(std::string_view section, std::string_view key, std::string_view value) {
+        if (key == "ReleaseDate") {
+            dates_[std::string(section)] = value;
+        } else {
+            components_.push_back({std::string(section), std::string(key), std::string(value)});
+        }
+    }
+
+    void build(SofaSnapshot& snapshot) const {
+        snapshot.staging_->xprotect.reserve(components_.size());
+        for (const auto& component : components_) {
+            auto date = dates_.find(component.section);
+            snapshot.addXProtect(component.section, component.identifier, component.version,
+                                 date != dates_.end() ? date->second : std::string());
+        }
+    }
+
+ private:
+    struct Component {
+        std::string section;
+        std::string identifier;
+        std::string version;
+    };
+
+    std::vector<Component> components_;
+    std::map<std::string, std::string> dates_;
+};
+
+// nlohmann SAX handler that fills a SofaSnapshot straight from parser events,
+// so the feed is never materialized as a DOM. It tracks just enough of the
+// path to recognize OSVersions[*].OSVersion, Models.<id>.SupportedOS[*],
+// the OSVersions[*].Latest fields, OSVersions[*].SecurityReleases[*] and the
+// XProtect sections.
+class SnapshotSaxBuilder {
+ public:
+    using number_integer_t = json::number_integer_t;
+    using number_unsigned_t = json::number_unsigned_t;
+    using number_float_t = json::number_float_t;
+    using string_t = json::string_t;
+    using binary_t = json::binary_t;
+
+    SnapshotSaxBuilder() : snapshot_(std::make_shared<SofaSnapshot>()) {}
+
+    bool null() { return value(); }
+    bool boolean(bool) { return value(); }
+    bool number_integer(number_integer_t n) {
+        if (n >= 0) {
+            count(static_cast<number_unsigned_t>(n));
+        }
+        return value();
+    }
+
+    bool number_unsigned(number_unsigned_t n) {
+        count(n);
+        return value();
+    }
+
+    bool number_float(number_float_t, const string_t&) { return value(); }
+    bool binary(binary_t&) { return value(); }
+
+    bool string(string_t& s) {
+        if (inSupportedOs()) {
+            snapshot_->addSupportedOs(s);
+        } else if (inOsVersion()) {
+            size_t release = path_[1].index;
+            if (release == 0) {
+                snapshot_->setLatestOs(s);
+                has_latest_ = true;
+            }
+            releases_.setOsName(release, s);
+        } else if (inLatest("ProductVersion")) {
+            releases_.setVersion(path_[1].index, s);
+        } else if (inLatest("ReleaseDate")) {
+            releases_.setDate(path_[1].index, s);
+        } else if (inSupportedDevices()) {
+            releases_.addDevice(path_[1].index, s);
+        } else if (inSecurityRelease("ProductVersion")) {
+            releases_.setSecurityVersion(path_[1].index, path_[3].index, s);
+        } else if (inSecurityRelease("ReleaseDate")) {
+            releases_.setSecurityDate(path_[1].index, path_[3].index, s);
+        } else if (inExploitedCves()) {
+            releases_.addExploitedCve(path_[1].index, path_[3].index);
+        } else if (path_.size() == 2 && !path_[1].is_array &&
+                   FeedXProtect::isSection(path_[0].key)) {
+            xprotect_.set(path_[0].key, path_[1].key, s);
+        }
+        return value();
+    }
+
+    bool start_object(std::size_t) {
+        if (path_.size() == 2 && path_[0].key == "Models" && !path_[1].is_array) {
+            snapshot_->beginModel(path_[1].key);
+        }
+        path_.push_back({false, 0, {}});
+        return true;
+    }
+
+    bool key(string_t& k) {
+        if (path_.size() == 1 && k == "Models") {
+            has_models_ = true;
+        }
+        path_.back().key = k;
+        return true;
+    }
+
+    bool end_object() {
+        path_.pop_back();
+        return value();
+    }
+
+    bool start_array(std::size_t) {
+        path_.push_back({true, 0, {}});
+        return true;
+    }
+
+    bool end_array() {
+        path_.pop_back();
+        return value();
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex) {
+        error_ = ex.what();
+        return false;
+    }
+
+    // The finished index, or nullptr if parsing failed or required fields are missing
+    std::shared_ptr<const SofaSnapshot> finish(std::string& error) {
+        if (!error_.empty()) {
+            error = error_;
+            return nullptr;
+        }
+        if (!has_latest_ || (!has_models_ && !releases_.hasDevices())) {
+            error = "SOFA feed is missing OSVersions or Models";
+            return nullptr;
+        }
+        releases_.build(*snapshot_, !has_models_);
+        xprotect_.build(*snapshot_);
+        snapshot_->finish();
+        return snapshot_;
+    }
+
+ private:
+    struct Frame {
+        bool is_array;
+        size_t index = 0;
+        std::string key;
+    };
+
+    bool value() {
+        if (!path_.empty() && path_.back().is_array) {
+            path_.back().index++;
+        }
+        return true;
+    }
+
+    void count(number_unsigned_t n) {
+        if (inSecurityRelease("UniqueCVEsCount")) {
+            releases_.setSecurityCves(path_[1].index, path_[3].index,
+                                      static_cast<uint32_t>(std::min<number_unsigned_t>(n, UINT32_MAX)));
+        }
+    }
+
+    // OSVersions[*].OSVersion
+    bool inOsVersion() const {
+        return path_.size() == 3 && path_[0].key == "OSVersions" && path_[1].is_array &&
+               !path_[2].is_array && path_[2].key == "OSVersion";
+    }
+
+    // OSVersions[*].Latest.<field>
+    bool inLatest(std::string_view field) const {
+        return path_.size() == 4 && path_[0].key == "OSVersions" && path_[1].is_array &&
+               path_[2].key == "Latest" && !path_[3].is_array && path_[3].key == field;
+    }
+
+    // OSVersions[*].SecurityReleases[*].<field>
+    bool inSecurityRelease(std::string_view field) const {
+        return path_.size() == 5 && path_[0].key == "OSVersions" && path_[1].is_array &&
+               path_[2].key == "SecurityReleases" && path_[3].is_array &&
+               !path_[4].is_array && path_[4].key == field;
+    }
+
+    // OSVersions[*].SecurityReleases[*].ActivelyExploitedCVEs[*]
+    bool inExploitedCves() const {
+        return path_.size() == 6 && path_[0].key == "OSVersions" && path_[1].is_array &&
+               path_[2].key == "SecurityReleases" && path_[3].is_array &&
+               path_[4].key == "ActivelyExploitedCVEs" && path_[5].is_array;
+    }
+
+    // OSVersions[*].Latest.SupportedDevices[*]
+    bool inSupportedDevices() const {
+        return path_.size() == 5 && path_[0].key == "OSVersions" && path_[1].is_array &&
+               path_[2].key == "Latest" && path_[3].key == "SupportedDevices" &&
+               path_[4].is_array;
+    }
+
+    // Models.<id>.SupportedOS[*]
+    bool inSupportedOs() const {
+        return path_.size() == 4 && path_[0].key == "Models" && !path_[1].is_array &&
+               path_[2].key == "SupportedOS" && path_[3].is_array;
+    }
+
+    std::shared_ptr<SofaSnapshot> snapshot_;
+    std::vector<Frame> path_;
+    bool has_latest_ = false;
+    bool has_models_ = false;
+    FeedReleases releases_;
+    FeedXProtect xprotect_;
+    std::string error_;
+};
+
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+// Uses simdjson error codes only, so it also builds with exceptions disabled
+std::shared_ptr<const SofaSnapshot> SofaSnapshot::fromSimdjson(const char* data,
+                                                          size_t size,
+                                                          size_t capacity,
+                                                          std::string& error) {
+    auto fail = [&error](simdjson::error_code code) {
+        error = simdjson::error_message(code);
+        return nullptr;
+    };
+    // Values of another type are skipped as the SAX builder skips them;
+    // any other error means the document itself is malformed
+    auto wrongType = [](simdjson::error_code code) {
+        return code == simdjson::INCORRECT_TYPE || code == simdjson::NUMBER_OUT_OF_RANGE;
+    };
+
+    auto snapshot = std::make_shared<SofaSnapshot>();
+    bool has_latest = false;
+    bool has_models = false;
+    FeedReleases releases;
+    FeedXProtect xprotect;
+
+    simdjson::ondemand::parser parser;
+    simdjson::ondemand::document doc;
+    simdjson::ondemand::object root;
+    if (auto code = parser.iterate(data, size, capacity).get(doc)) {
+        return fail(code);
+    }
+    if (auto code = doc.get_object().get(root)) {
+        return fail(code);
+    }
+    for (auto field : root) {
+        std::string_view key;
+        if (auto code = field.unescaped_key().get(key)) {
+            return fail(code);
+        }
+        if (key == "OSVersions") {
+            simdjson::ondemand::array versions;
+            if (auto code = field.value().get_array().get(versions)) {
+                if (wrongType(code)) {
+                    continue;
+                }
+                return fail(code);
+            }
+            size_t next_release = 0;
+            for (auto os : versions) {
+                // Entries that are skipped still take an index, as in the SAX builder
+                const size_t release = next_release++;
+                simdjson::ondemand::object entry;
+                if (auto code = os.get_object().get(entry)) {
+                    if (wrongType(code)) {
+                        continue;
+                    }
+                    return fail(code);
+                }
+                for (auto attr : entry) {
+                    std::string_view attr_key;
+                    if (auto code = attr.unescaped_key().get(attr_key)) {
+                        return fail(code);
+                    }
+                    if (attr_key == "OSVersion") {
+                        std::string_view name;
+                        if (auto code = attr.value().get_string().get(name)) {
+                            if (wrongType(code)) {
+                                continue;
+                            }
+                            return fail(code);
+                        }
+                        if (release == 0) {
+                            snapshot->setLatestOs(name);
+                            has_latest = true;
+                        }
+                        releases.setOsName(release, name);
+                    } else if (attr_key == "Latest") {
+                        simdjson::ondemand::object latest;
+                        if (auto code = attr.value().get_object().get(latest)) {
+                            if (wrongType(code)) {
+                                continue;
+                            }
+                            return fail(code);
+                        }
+                        for (auto latest_attr : latest) {
+                            std::string_view latest_key;
+                            if (auto code = latest_attr.unescaped_key().get(latest_key)) {
+                                return fail(code);
+                            }
+                            if (latest_key == "ProductVersion") {
+                                std::string_view version;
+                                if (auto code = latest_attr.value().get_string().get(version)) {
+                                    if (wrongType(code)) {
+                                        continue;
+                                    }
+                                    return fail(code);
+                                }
+                                releases.setVersion(release, version);
+                            } else if (latest_key == "ReleaseDate") {
+                                std::string_view date;
+                                if (auto code = latest_attr.value().get_string().get(date)) {
+                                    if (wrongType(code)) {
+                                        continue;
+                                    }
+                                    return fail(code);
+                                }
+                                releases.setDate(release, date);
+                            } else if (latest_key == "SupportedDevices") {
+                                simdjson::ondemand::array supported;
+                                if (auto code = latest_attr.value().get_array().get(supported)) {
+                                    if (wrongType(code)) {
+                                        continue;
+                                    }
+                                    return fail(code);
+                                }
+                                for (auto device : supported) {
+                                    std::string_view identifier;
+                                    if (auto code = device.get_string().get(identifier)) {
+                                        if (wrongType(code)) {
+                                            continue;
+                                        }
+                                        return fail(code);
+                                    }
+                                    releases.addDevice(release, identifier);
+                                }
+                            }
+                        }
+                    } else if (attr_key == "SecurityReleases") {
+                        simdjson::ondemand::array updates;
+                        if (auto code = attr.value().get_array().get(updates)) {
+                            if (wrongType(code)) {
+                                continue;
+                            }
+                            return fail(code);
+                        }
+                        size_t next_update = 0;
+                        for (auto item : updates) {
+                            const size_t update = next_update++;
+                            simdjson::ondemand::object fields;
+                            if (auto code = item.get_object().get(fields)) {
+                                if (wrongType(code)) {
+                                    continue;
+                                }
+                                return fail(code);
+                            }
+                            for (auto update_attr : fields) {
+                                std::string_view update_key;
+                                if (auto code = update_attr.unescaped_key().get(update_key)) {
+                                    return fail(code);
+                                }
+                                if (update_key == "ProductVersion" || update_key == "ReleaseDate") {
+                                    std::string_view value;
+                                    if (auto code = update_attr.value().get_string().get(value)) {
+                                        if (wrongType(code)) {
+                                            continue;
+                                        }
+                                        return fail(code);
+                                    }
+                                    if (update_key == "ProductVersion") {
+                                        releases.setSecurityVersion(release, update, value);
+                                    } else {
+                                        releases.setSecurityDate(release, update, value);
+                                    }
+                                } else if (update_key == "UniqueCVEsCount") {
+                                    // Null, negative or fractional counts read as 0
+                                    uint64_t cves = 0;
+                                    if (auto code = update_attr.value().get_uint64().get(cves)) {
+                                        if (!wrongType(code)) {
+                                            return fail(code);
+                                        }
+                                        cves = 0;
+                                    }
+                                    releases.setSecurityCves(
+                                        release, update,
+                                        static_cast<uint32_t>(std::min<uint64_t>(cves, UINT32_MAX)));
+                                } else if (update_key == "ActivelyExploitedCVEs") {
+                                    simdjson::ondemand::array exploited;
+                                    if (auto code = update_attr.value().get_array().get(exploited)) {
+                                        if (wrongType(code)) {
+                                            continue;
+                                        }
+                                        return fail(code);
+                                    }
+                                    for (auto cve : exploited) {
+                                        std::string_view cve_id;
+                                        if (auto code = cve.get_string().get(cve_id)) {
+                                            if (wrongType(code)) {
+                                                continue;
+                                            }
+                                            return fail(code);
+                                        }
+                                        releases.addExploitedCve(release, update);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        } else if (FeedXProtect::isSection(key)) {
+            std::string section(key);
+            simdjson::ondemand::object fields;
+            if (auto code = field.value().get_object().get(fields)) {
+                if (wrongType(code)) {
+                    continue;
+                }
+                return fail(code);
+            }
+            for (auto item : fields) {
+                std::string_view item_key;
+                std::string_view value;
+                if (auto code = item.unescaped_key().get(item_key)) {
+                    return fail(code);
+                }
+                // A null ReleaseDate or a nested object is not a version
+                if (auto code = item.value().get_string().get(value)) {
+                    if (wrongType(code)) {
+                        continue;
+                    }
+                    return fail(code);
+                }
+                xprotect.set(section, item_key, value);
+            }
+        } else if (key == "Models") {
+            has_models = true;
+            simdjson::ondemand::object models;
+            if (auto code = field.value().get_object().get(models)) {
+                if (wrongType(code)) {
+                    continue;
+                }
+                return fail(code);
+            }
+            for (auto model : models) {
+                std::string_view identifier;
+                simdjson::ondemand::object attrs;
+                if (auto code = model.unescaped_key().get(identifier)) {
+                    return fail(code);
+                }
+                if (auto code = model.value().get_object().get(attrs)) {
+                    if (wrongType(code)) {
+                        continue;
+                    }
+                    return fail(code);
+                }
+                snapshot->beginModel(identifier);
+                for (auto attr : attrs) {
+                    std::string_view attr_key;
+                    if (auto code = attr.unescaped_key().get(attr_key)) {
+                        return fail(code);
+                    }
+                    if (attr_key != "SupportedOS") {
+                        continue;
+                    }
+                    simdjson::ondemand::array supported;
+                    if (auto code = attr.value().get_array().get(supported)) {
+                        if (wrongType(code)) {
+                            continue;
+                        }
+                        return fail(code);
+                    }
+                    for (auto os : supported) {
+                        std::string_view name;
+                        if (auto code = os.get_string().get(name)) {
+                            if (wrongType(code)) {
+                                continue;
+                            }
+                            return fail(code);
+                        }
+                        snapshot->addSupportedOs(name);
+                    }
+                }
+            }
+        }
+    }
+    if (!has_latest || (!has_models && !releases.hasDevices())) {
+        error = "SOFA feed is missing OSVersions or Models";
+        return nullptr;
+    }
+    releases.build(*snapshot, !has_models);
+    xprotect.build(*snapshot);
+    snapshot->finish();
+    return snapshot;
+}
+#endif
+
+std::shared_ptr<const SofaSnapshot> SofaSnapshot::read(std::istream& in, std::string& error) {
+    SnapshotSaxBuilder builder;
+    json::sax_parse(in, &builder);
+    return builder.finish(error);
+}
+
+// The format version in an index's magic, 0 if data is not an index.
+// Older versions are still read.
+static int indexVersion(std::string_view data) {
+    auto magic = SofaSnapshot::kIndexMagic;
+    auto prefix = magic.substr(0, magic.size() - 1);
+    if (data.size() < magic.size() || data.substr(0, prefix.size()) != prefix) {
+        return 0;
+    }
+    char version = data[prefix.size()];
+    return version >= '1' && version <= magic.back() ? version - '0' : 0;
+}
+
+static bool isIndex(std::string_view data) { return indexVersion(data) != 0; }
+
+std::shared_ptr<const SofaSnapshot> SofaSnapshot::parse(std::string& data, std::string& error) {
+    if (isIndex(data)) {
+        return deserialize(data, error);
+    }
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+    // Pad the buffer in place rather than copying it
+    size_t size = data.size();
+    data.reserve(size + simdjson::SIMDJSON_PADDING);
+    return fromSimdjson(data.data(), size, data.capacity(), error);
+#else
+    SnapshotSaxBuilder builder;
+    json::sax_parse(data, &builder);
+    return builder.finish(error);
+#endif
+}
+
+std::shared_ptr<const SofaSnapshot> SofaSnapshot::load(const std::string& path,
+                                                       std::string& error) {
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+    simdjson::padded_string data;
+    if (auto code = simdjson::padded_string::load(path).get(data)) {
+        error = "Cannot read " + path + ": " + simdjson::error_message(code);
+        return nullptr;
+    }
+    if (isIndex(data)) {
+        return deserialize(data, error);
+    }
+    return fromSimdjson(data.data(), data.size(), data.size() + simdjson::SIMDJSON_PADDING,
+                        error);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        error = "Cannot open " + path;
+        return nullptr;
+    }
+
+    char magic[kIndexMagic.size()];
+    file.read(magic, sizeof(magic));
+    if (isIndex(std::string_view(magic, static_cast<size_t>(file.gcount())))) {
+        std::string data(magic, sizeof(magic));
+        data.append(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return deserialize(data, error);
+    }
+    file.clear();
+    file.seekg(0);
+    return read(file, error);
+#endif
+}
+
+// Compact index layout, all integers little-endian u32:
+//   kIndexMagic
+//   latest OS name
+//   OS name count, names
+//   model count, then per model: identifier, OS count, OS name indices
+//   release count, then per release: OS name index, ProductVersion,
+//     ReleaseDate, security release count, then per security release:
+//     ProductVersion, ReleaseDate, CVE count, exploited CVE count
+//   XProtect component count, then per component: section, identifier,
+//     version, ReleaseDate
+// Strings are a length followed by the bytes. SOFAIDX1 indexes end after
+// the models, SOFAIDX2 releases stop after the ProductVersion and SOFAIDX3
+// indexes end after the releases.
+
+static void putU32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static void putString(std::string& out, std::string_view value) {
+    putU32(out, static_cast<uint32_t>(value.size()));
+    out.append(value.data(), value.size());
+}
+
+// Bounds-checked reader for the compact index; any overrun sets ok to false
+struct IndexReader {
+    std::string_view data;
+    size_t offset = 0;
+    bool ok = true;
+
+    uint32_t u32() {
+        if (!ok || data.size() - offset < 4) {
+            ok = false;
+            return 0;
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(data[offset + i])) << (8 * i);
+        }
+        offset += 4;
+        return value;
+    }
+
+    std::string_view string() {
+        uint32_t size = u32();
+        if (!ok || data.size() - offset < size) {
+            ok = false;
+            return {};
+        }
+        auto value = data.substr(offset, size);
+        offset += size;
+        return value;
+    }
+};
+
+std::string SofaSnapshot::serialize() const {
+    return encode(models_.data(), models_.size(), true);
+}
+
+std::string SofaSnapshot::serializeModel(std::string_view model_identifier) const {
+    auto it = std::lower_bound(models_.begin(), models_.end(), model_identifier,
+        [](const ModelEntry& e, std::string_view id) { return e.identifier < id; });
+    if (it == models_.end() || it->identifier != model_identifier) {
+        return encode(nullptr, 0, false);
+    }
+    return encode(&*it, 1, false);
+}
+
+std::string SofaSnapshot::encode(const ModelEntry* models,
+                                 size_t count,
+                                 bool all_releases) const {
+    // Only the names the encoded models and releases reference go into the
+    // name table. Interned names are compared by address.
+    std::vector<std::string_view> names;
+    auto nameIndex = [&names](std::string_view os) {
+        size_t index = 0;
+        while (index < names.size() && names[index].data() != os.data()) {
+            index++;
+        }
+        if (index == names.size()) {
+            names.push_back(os);
+        }
+        return static_cast<uint32_t>(index);
+    };
+    std::vector<uint32_t> indices;
+    for (size_t m = 0; m < count; m++) {
+        for (uint32_t i = 0; i < models[m].os_count; i++) {
+            indices.push_back(nameIndex(supported_os_[models[m].first_os + i]));
+        }
+    }
+
+    // A slice keeps the releases its models support plus the latest one
+    std::vector<std::pair<uint32_t, const Release*>> releases;
+    size_t referenced = names.size();
+    for (const auto& release : releases_) {
+        bool wanted = all_releases || release.os.data() == latest_os_.data();
+        for (size_t i = 0; !wanted && i < referenced; i++) {
+            wanted = names[i].data() == release.os.data();
+        }
+        if (wanted) {
+            releases.emplace_back(nameIndex(release.os), &release);
+        }
+    }
+
+    std::string out(kIndexMagic);
+    putString(out, latest_os_);
+    putU32(out, static_cast<uint32_t>(names.size()));
+    for (const auto& name : names) {
+        putString(out, name);
+    }
+
+    putU32(out, static_cast<uint32_t>(count));
+    size_t next = 0;
+    for (size_t m = 0; m < count; m++) {
+        putString(out, models[m].identifier);
+        putU32(out, models[m].os_count);
+        for (uint32_t i = 0; i < models[m].os_count; i++) {
+            putU32(out, indices[next++]);
+        }
+    }
+
+    putU32(out, static_cast<uint32_t>(releases.size()));
+    for (const auto& [index, release] : releases) {
+        putU32(out, index);
+        putString(out, release->version);
+        putString(out, release->date);
+        putU32(out, release->security_count);
+        for (uint32_t i = 0; i < release->security_count; i++) {
+            const auto& update = security_releases_[release->first_security + i];
+            putString(out, update.version);
+            putString(out, update.date);
+            putU32(out, update.cves);
+            putU32(out, update.exploited);
+        }
+    }
+
+    // XProtect versions do not depend on the model, so slices keep them all
+    putU32(out, static_cast<uint32_t>(xprotect_.size()));
+    for (const auto& component : xprotect_) {
+        putString(out, component.section);
+        putString(out, component.identifier);
+        putString(out, component.version);
+        putString(out, component.date);
+    }
+    return out;
+}
+
+std::shared_ptr<const SofaSnapshot> SofaSnapshot::deserialize(std::string_view data,
+                                                              std::string& error) {
+    int version = indexVersion(data);
+    if (version == 0) {
+        error = "Not a SOFA index";
+        return nullptr;
+    }
+    IndexReader reader{data, kIndexMagic.size()};
+    auto snapshot = std::make_shared<SofaSnapshot>();
+    snapshot->setLatestOs(reader.string());
+
+    // Each name takes at least its 4-byte length; a corrupt count larger
+    // than the rest of the index could hold is rejected before allocating
+    uint32_t name_count = reader.u32();
+    if (name_count > (data.size() - reader.offset) / sizeof(uint32_t)) {
+        reader.ok = false;
+        name_count = 0;
+    }
+    std::vector<std::string_view> names(name_count);
+    for (auto& name : names) {
+        name = snapshot->intern(reader.string());
+    }
+
+    // Each model takes at least 8 bytes, which bounds a corrupt count
+    uint32_t model_count = reader.u32();
+    snapshot->staging_->models.reserve(std::min<size_t>(model_count, data.size() / 8));
+    for (uint32_t m = 0; m < model_count && reader.ok; m++) {
+        snapshot->beginModel(reader.string());
+        uint32_t os_count = reader.u32();
+        for (uint32_t i = 0; i < os_count && reader.ok; i++) {
+            uint32_t index = reader.u32();
+            if (index >= names.size()) {
+                reader.ok = false;
+                break;
+            }
+            snapshot->addSupportedOs(names[index]);
+        }
+    }
+
+    if (version >= 2) {
+        uint32_t release_count = reader.u32();
+        snapshot->staging_->releases.reserve(std::min<size_t>(release_count, data.size() / 8));
+        for (uint32_t r = 0; r < release_count && reader.ok; r++) {
+            uint32_t index = reader.u32();
+            std::string_view product_version = reader.string();
+            std::string_view date = version >= 3 ? reader.string() : std::string_view();
+            if (!reader.ok || index >= names.size()) {
+                reader.ok = false;
+                break;
+            }
+            snapshot->addRelease(names[index], product_version, date);
+            uint32_t update_count = version >= 3 ? reader.u32() : 0;
+            for (uint32_t i = 0; i < update_count && reader.ok; i++) {
+                std::string_view update_version = reader.string();
+                std::string_view update_date = reader.string();
+                uint32_t cves = reader.u32();
+                uint32_t exploited = reader.u32();
+                if (reader.ok) {
+                    snapshot->addSecurityRelease(update_version, update_date, cves, exploited);
+                }
+            }
+        }
+    }
+
+    if (version >= 4) {
+        uint32_t component_count = reader.u32();
+        snapshot->staging_->xprotect.reserve(std::min<size_t>(component_count, data.size() / 16));
+        for (uint32_t i = 0; i < component_count && reader.ok; i++) {
+            std::string_view section = reader.string();
+            std::string_view identifier = reader.string();
+            std::string_view component_version = reader.string();
+            std::string_view date = reader.string();
+            if (reader.ok) {
+                snapshot->addXProtect(section, identifier, component_version, date);
+            }
+        }
+    }
+
+    if (!reader.ok || reader.offset != data.size()) {
+        error = "Truncated or malformed SOFA index";
+        return nullptr;
+    }
+    snapshot->finish();
+    return snapshot;
+}
+
+std::string HttpFixture::encode() const {
+    return encodeHead(body.size()) + body;
+}
+
+std::string HttpFixture::encodeHead(size_t body_size) const {
+    char elapsed[32];
+    snprintf(elapsed, sizeof(elapsed), "%.3f", elapsed_ms);
+    std::string out;
+    out += "url: " + url + "\n";
+    out += "request-etag: " + request_etag + "\n";
+    out += "status: " + std::to_string(status) + "\n";
+    out += "elapsed-ms: " + std::string(elapsed) + "\n";
+    out += "etag: " + etag + "\n";
+    out += "content-type: " + content_type + "\n";
+    if (endless) {
+        out += "endless: 1\n";
+    }
+    out += "body-length: " + std::to_string(body_size) + "\n\n";
+    return out;
+}
+
+bool HttpFixture::decode(std::string_view data, HttpFixture& fixture) {
+    size_t body_length = 0;
+    bool has_length = false;
+    size_t pos = 0;
+    while (true) {
+        size_t end = data.find('\n', pos);
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        std::string_view line = data.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.empty()) {
+            break;
+        }
+        size_t colon = line.find(": ");
+        if (colon == std::string_view::npos) {
+            return false;
+        }
+        std::string_view name = line.substr(0, colon);
+        std::string value(line.substr(colon + 2));
+        if (name == "url") {
+            fixture.url = value;
+        } else if (name == "request-etag") {
+            fixture.request_etag = value;
+        } else if (name == "status") {
+            fixture.status = std::strtol(value.c_str(), nullptr, 10);
+        } else if (name == "elapsed-ms") {
+            fixture.elapsed_ms = std::strtod(value.c_str(), nullptr);
+        } else if (name == "etag") {
+            fixture.etag = value;
+        } else if (name == "content-type") {
+            fixture.content_type = value;
+        } else if (name == "endless") {
+            fixture.endless = value == "1";
+        } else if (name == "body-length") {
+            body_length = std::strtoull(value.c_str(), nullptr, 10);
+            has_length = true;
+        }
+    }
+    if (!has_length || data.size() - pos != body_length || fixture.status == 0) {
+        return false;
+    }
+    fixture.body = std::string(data.substr(pos));
+    return true;
+}
+
+std::string FeedHash::ofFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return "";
+    }
+    FeedHash hash;
+    char buffer[64 * 1024];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        hash.update(buffer, static_cast<size_t>(file.gcount()));
+    }
+    return hash.hex();
+}
+
+} // namespace osquery
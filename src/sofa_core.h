@@ -0,0 +1,472 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Core of the SOFA feed index, shared by the osquery extension and the
+// sofa_mirror server. Nothing here depends on osquery.
+
+namespace osquery {
+
+// Bump allocator backing a SofaSnapshot. Memory is carved out of a few large
+// blocks and only released, all at once, when the arena is destroyed.
+class Arena {
+ public:
+    explicit Arena(size_t first_block = 16 * 1024) : next_block_(first_block) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t align) {
+        void* p = cursor_;
+        size_t space = remaining_;
+        if (cursor_ == nullptr || std::align(align, bytes, p, space) == nullptr) {
+            size_t size = std::max(next_block_, bytes + align);
+            blocks_.emplace_back(new char[size]);
+            reserved_ += size;
+            next_block_ = std::min(size * 2, kMaxBlock);
+            p = blocks_.back().get();
+            space = size;
+            std::align(align, bytes, p, space);
+        }
+        cursor_ = static_cast<char*>(p) + bytes;
+        remaining_ = space - bytes;
+        return p;
+    }
+
+    // Copy a string into the arena; the view stays valid for the arena's lifetime
+    std::string_view store(std::string_view s) {
+        if (s.empty()) {
+            return {};
+        }
+        char* p = static_cast<char*>(allocate(s.size(), 1));
+        std::memcpy(p, s.data(), s.size());
+        return {p, s.size()};
+    }
+
+    size_t blocks() const { return blocks_.size(); }
+    size_t reserved() const { return reserved_; }
+
+ private:
+    static constexpr size_t kMaxBlock = 1024 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* cursor_ = nullptr;
+    size_t remaining_ = 0;
+    size_t next_block_;
+    size_t reserved_ = 0;
+};
+
+// Standard allocator adapter so containers can live inside an Arena.
+// Deallocation is a no-op; the arena frees everything at once.
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+    Arena* arena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Range over a model's supported OS names, newest first
+struct OsList {
+    const std::string_view* first = nullptr;
+    size_t size = 0;
+
+    bool empty() const { return size == 0; }
+    const std::string_view* begin() const { return first; }
+    const std::string_view* end() const { return first + size; }
+    std::string_view front() const { return first[0]; }
+};
+
+// Pack a dotted version such as "17.6.1" into one integer that compares like
+// the version: 12 bits of major, 10 of minor, 10 of patch. Missing or
+// non-numeric components count as 0 and larger ones saturate.
+inline uint32_t packVersion(std::string_view version) {
+    static constexpr uint32_t kLimits[3] = {4095, 1023, 1023};
+    static constexpr int kShifts[3] = {20, 10, 0};
+    uint32_t packed = 0;
+    size_t pos = 0;
+    for (int part = 0; part < 3 && pos < version.size(); part++) {
+        uint32_t value = 0;
+        while (pos < version.size() && version[pos] >= '0' && version[pos] <= '9') {
+            value = std::min(value * 10 + static_cast<uint32_t>(version[pos] - '0'),
+                             kLimits[part]);
+            pos++;
+        }
+        packed |= value << kShifts[part];
+        if (pos >= version.size() || version[pos] != '.') {
+            break;
+        }
+        pos++;
+    }
+    return packed;
+}
+
+// Index of one SOFA feed download. For feeds with a Models map (macOS) the
+// index is keyed by model identifier; for feeds without one (iOS/iPadOS) it
+// is keyed by device identifier, built from each release's SupportedDevices.
+// All strings and tables are allocated in the snapshot's arena: building it
+// costs a handful of block allocations and dropping the snapshot releases
+// everything in one step. The tables grow in ordinary vectors while the
+// snapshot is built and are copied into the arena once by finish(), since
+// buffers a growing arena vector leaves behind could never be reused.
+class SofaSnapshot {
+ public:
+    SofaSnapshot()
+        : models_(ArenaAllocator<ModelEntry>(arena_)),
+          supported_os_(ArenaAllocator<std::string_view>(arena_)),
+          releases_(ArenaAllocator<Release>(arena_)),
+          security_releases_(ArenaAllocator<SecurityRelease>(arena_)),
+          supported_releases_(ArenaAllocator<const Release*>(arena_)),
+          xprotect_(ArenaAllocator<XProtectComponent>(arena_)) {}
+    SofaSnapshot(const SofaSnapshot&) = delete;
+    SofaSnapshot& operator=(const SofaSnapshot&) = delete;
+
+    // The parse entry points never throw on bad input: they return nullptr
+    // and describe the problem in error.
+
+    // Parse feed text with the backend selected at build time, or decode
+    // the compact index if data holds one
+    static std::shared_ptr<const SofaSnapshot> parse(std::string& data, std::string& error);
+
+    // Parse a feed stream incrementally with the SAX builder
+    static std::shared_ptr<const SofaSnapshot> read(std::istream& in, std::string& error);
+
+    // Parse a cached feed file, either JSON or the compact index
+    static std::shared_ptr<const SofaSnapshot> load(const std::string& path, std::string& error);
+
+    // Decode the compact index produced by serialize()
+    static std::shared_ptr<const SofaSnapshot> deserialize(std::string_view data,
+                                                           std::string& error);
+
+    // Compact binary form of the index, served by sofa_mirror and cached by
+    // the extension. It starts with kIndexMagic so loaders can tell it from
+    // the JSON feed.
+    std::string serialize() const;
+
+    // The same format restricted to one model: the latest release plus that
+    // model's supported OS list, a few hundred bytes. Unknown models yield
+    // an index without models.
+    std::string serializeModel(std::string_view model_identifier) const;
+
+    // Identifiers of every model in the feed, sorted
+    std::vector<std::string_view> modelIdentifiers() const {
+        std::vector<std::string_view> identifiers;
+        identifiers.reserve(models_.size());
+        for (const auto& model : models_) {
+            identifiers.push_back(model.identifier);
+        }
+        return identifiers;
+    }
+
+    static constexpr std::string_view kIndexMagic = "SOFAIDX4";
+
+    // One entry of a release's SecurityReleases
+    struct SecurityRelease {
+        std::string_view version;
+        uint32_t packed;
+        std::string_view date;
+        // UniqueCVEsCount, and the number of ActivelyExploitedCVEs
+        uint32_t cves;
+        uint32_t exploited;
+    };
+
+    // One OSVersions entry: the OS name, the ProductVersion of its latest
+    // build (also packed with packVersion() for comparisons) and its
+    // ReleaseDate, plus the release's security updates, newest first
+    struct Release {
+        std::string_view os;
+        std::string_view version;
+        uint32_t packed;
+        std::string_view date;
+        uint32_t first_security;
+        uint32_t security_count;
+    };
+
+    // One component version from the feed's XProtectPayloads or
+    // XProtectPlistConfigData, with the section's ReleaseDate
+    struct XProtectComponent {
+        std::string_view section;
+        std::string_view identifier;
+        std::string_view version;
+        std::string_view date;
+    };
+
+    // CVEs fixed by a release line's security updates newer than a version
+    struct CveDelta {
+        uint32_t cves = 0;
+        uint32_t exploited = 0;
+    };
+
+    // Range over the releases of the OS names a model supports
+    struct ReleaseList {
+        const Release* const* first = nullptr;
+        size_t size = 0;
+
+        bool empty() const { return size == 0; }
+        const Release* const* begin() const { return first; }
+        const Release* const* end() const { return first + size; }
+    };
+
+    std::string_view latestOs() const { return latest_os_; }
+
+    // Release details for an OS name, or nullptr if the feed has none
+    const Release* release(std::string_view os) const {
+        for (const auto& release : releases_) {
+            if (release.os == os) {
+                return &release;
+            }
+        }
+        return nullptr;
+    }
+
+    OsList supportedOs(std::string_view model_identifier) const {
+        const ModelEntry* model = findModel(model_identifier);
+        if (model == nullptr) {
+            return {};
+        }
+        return {supported_os_.data() + model->first_os, model->os_count};
+    }
+
+    // The release of every OS the model supports, newest first. The lists
+    // are resolved once per snapshot; OS names without release details are
+    // left out.
+    ReleaseList supportedReleases(std::string_view model_identifier) const {
+        const ModelEntry* model = findModel(model_identifier);
+        if (model == nullptr) {
+            return {};
+        }
+        return {supported_releases_.data() + model->first_release, model->release_count};
+    }
+
+    const ArenaVector<XProtectComponent>& xprotect() const { return xprotect_; }
+
+    CveDelta cvesSince(const Release& release, uint32_t packed_version) const {
+        CveDelta delta;
+        for (uint32_t i = 0; i < release.security_count; i++) {
+            const auto& update = security_releases_[release.first_security + i];
+            if (update.packed > packed_version) {
+                delta.cves += update.cves;
+                delta.exploited += update.exploited;
+            }
+        }
+        return delta;
+    }
+
+    const Arena& arena() const { return arena_; }
+
+ private:
+    friend class SnapshotSaxBuilder;
+    friend class FeedReleases;
+    friend class FeedXProtect;
+
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+    // Build the index with the simdjson on-demand API; data must be followed
+    // by at least SIMDJSON_PADDING bytes of capacity
+    static std::shared_ptr<const SofaSnapshot> fromSimdjson(const char* data,
+                                                            size_t size,
+                                                            size_t capacity,
+                                                            std::string& error);
+#endif
+
+    struct ModelEntry {
+        std::string_view identifier;
+        uint32_t first_os;
+        uint32_t os_count;
+        // Filled in by finish()
+        uint32_t first_release;
+        uint32_t release_count;
+    };
+
+    const ModelEntry* findModel(std::string_view model_identifier) const {
+        auto it = std::lower_bound(models_.begin(), models_.end(), model_identifier,
+            [](const ModelEntry& e, std::string_view id) { return e.identifier < id; });
+        if (it == models_.end() || it->identifier != model_identifier) {
+            return nullptr;
+        }
+        return &*it;
+    }
+
+    std::string encode(const ModelEntry* models, size_t count, bool all_releases) const;
+
+    void setLatestOs(std::string_view os) { latest_os_ = intern(os); }
+
+    void beginModel(std::string_view identifier) {
+        staging_->models.push_back({arena_.store(identifier),
+                                    static_cast<uint32_t>(staging_->supported_os.size()), 0, 0,
+                                    0});
+    }
+
+    void addSupportedOs(std::string_view os) {
+        staging_->supported_os.push_back(intern(os));
+        staging_->models.back().os_count++;
+    }
+
+    // Capacity for tables whose final sizes a builder knows up front
+    void reserveReleases(size_t releases, size_t security_releases) {
+        staging_->releases.reserve(releases);
+        staging_->security_releases.reserve(security_releases);
+    }
+
+    void addRelease(std::string_view os, std::string_view version, std::string_view date) {
+        staging_->releases.push_back(
+            {intern(os), arena_.store(version), packVersion(version), arena_.store(date),
+             static_cast<uint32_t>(staging_->security_releases.size()), 0});
+    }
+
+    // Add a security update to the release added last
+    void addSecurityRelease(std::string_view version,
+                            std::string_view date,
+                            uint32_t cves,
+                            uint32_t exploited) {
+        staging_->security_releases.push_back({arena_.store(version), packVersion(version),
+                                               arena_.store(date), cves, exploited});
+        staging_->releases.back().security_count++;
+    }
+
+    void addXProtect(std::string_view section,
+                     std::string_view identifier,
+                     std::string_view version,
+                     std::string_view date) {
+        staging_->xprotect.push_back({arena_.store(section), arena_.store(identifier),
+                                      arena_.store(version), arena_.store(date)});
+    }
+
+    // Move the tables into the arena, sort the models and resolve each
+    // model's releases. Nothing can be added afterwards.
+    void finish() {
+        Staging& staged = *staging_;
+        std::sort(staged.models.begin(), staged.models.end(),
+            [](const ModelEntry& a, const ModelEntry& b) { return a.identifier < b.identifier; });
+        copyToArena(staged.supported_os, supported_os_);
+        copyToArena(staged.releases, releases_);
+        copyToArena(staged.security_releases, security_releases_);
+        copyToArena(staged.xprotect, xprotect_);
+
+        std::vector<const Release*> resolved;
+        for (auto& model : staged.models) {
+            model.first_release = static_cast<uint32_t>(resolved.size());
+            for (uint32_t i = 0; i < model.os_count; i++) {
+                if (const Release* release = this->release(supported_os_[model.first_os + i])) {
+                    resolved.push_back(release);
+                    model.release_count++;
+                }
+            }
+        }
+        copyToArena(staged.models, models_);
+        copyToArena(resolved, supported_releases_);
+        staging_.reset();
+    }
+
+    template <typename T>
+    static void copyToArena(const std::vector<T>& staged, ArenaVector<T>& table) {
+        table.reserve(staged.size());
+        table.assign(staged.begin(), staged.end());
+    }
+
+    // OS names repeat across every model, keep a single copy of each
+    std::string_view intern(std::string_view os) {
+        for (const auto& name : staging_->os_names) {
+            if (name == os) {
+                return name;
+            }
+        }
+        staging_->os_names.push_back(arena_.store(os));
+        return staging_->os_names.back();
+    }
+
+    // The tables while the snapshot is built, released by finish()
+    struct Staging {
+        std::vector<ModelEntry> models;
+        std::vector<std::string_view> supported_os;
+        std::vector<std::string_view> os_names;
+        std::vector<Release> releases;
+        std::vector<SecurityRelease> security_releases;
+        std::vector<XProtectComponent> xprotect;
+    };
+
+    Arena arena_;
+    std::unique_ptr<Staging> staging_ = std::make_unique<Staging>();
+    std::string_view latest_os_;
+    ArenaVector<ModelEntry> models_;
+    ArenaVector<std::string_view> supported_os_;
+    ArenaVector<Release> releases_;
+    ArenaVector<SecurityRelease> security_releases_;
+    ArenaVector<const Release*> supported_releases_;
+    ArenaVector<XProtectComponent> xprotect_;
+};
+
+// One recorded HTTP exchange with a SOFA feed server. The extension writes
+// these with --macos_compatibility_record_dir and sofa_mirror --replay
+// serves them back, so fetch and parse runs can be repeated offline. The
+// file form is "name: value" lines, a blank line, then the raw body.
+struct HttpFixture {
+    std::string url;
+    // If-None-Match sent with the request, empty for an unconditional one
+    std::string request_etag;
+    long status = 0;
+    double elapsed_ms = 0;
+    std::string etag;
+    std::string content_type;
+    std::string body;
+    // Replay the body over and over without a Content-Length until the
+    // client hangs up; written by hand to test download limits
+    bool endless = false;
+
+    std::string encode() const;
+
+    // The header lines encode() puts before a body of body_size bytes, so a
+    // large body can be written after them without holding it in memory
+    std::string encodeHead(size_t body_size) const;
+
+    // Parse the file form; returns false if data is not a whole fixture
+    static bool decode(std::string_view data, HttpFixture& fixture);
+};
+
+// 64-bit FNV-1a, used as the integrity hash of the cached feed. It can be
+// computed incrementally while the body streams in.
+class FeedHash {
+ public:
+    void update(const char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash_ ^= static_cast<unsigned char>(data[i]);
+            hash_ *= 0x100000001b3ULL;
+        }
+    }
+
+    std::string hex() const {
+        char out[17];
+        snprintf(out, sizeof(out), "%016llx", static_cast<unsigned long long>(hash_));
+        return out;
+    }
+
+    // Hash of a whole file, or an empty string if it cannot be read
+    static std::string ofFile(const std::string& path);
+
+ private:
+    uint64_t hash_ = 0xcbf29ce484222325ULL;
+};
+
+} // namespace osquery
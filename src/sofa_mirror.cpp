@@ -0,0 +1,794 @@
+// sofa_mirror: a small LAN mirror for the SOFA macOS feed.
+//
+// It fetches the upstream feed on an interval, builds the compact index with
+// the same core the extension uses, and serves both over HTTP/1.1:
+//
+//   /v1/macos_data_feed.json   the upstream JSON, byte for byte
+//   /v1/macos_data_feed.bin    the compact index (SofaSnapshot::serialize)
+//   /v1/slices/<model>.bin     one model's slice of it (serializeModel)
+//
+// Responses carry strong ETags (FNV-1a of the identity body, suffixed with
+// -gzip for the compressed representation), honour If-None-Match, and are
+// gzip-compressed when the client accepts it. The gzip bodies are computed
+// once per refresh, not per request.
+//
+// With --replay DIR it serves fixtures the extension recorded with
+// --macos_compatibility_record_dir instead, each after its recorded
+// response time scaled by --replay-speed (0 answers at once), so fetch and
+// parse runs can be repeated on an offline machine.
+
+#include "sofa_core.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace osquery;
+
+namespace {
+
+const std::string kUpstreamUrl = "https://sofafeed.macadmins.io/v1/macos_data_feed.json";
+const std::string kUserAgent = "SOFA-mirror/1.0";
+constexpr size_t kMaxRequestBytes = 8 * 1024;
+// Idle keep-alive connections are dropped after this many seconds, or as
+// soon as other connections wait for a worker
+constexpr int kIdleSeconds = 30;
+// Accepted connections waiting for a worker, beyond which clients get a 503
+constexpr size_t kMaxQueuedConnections = 256;
+constexpr size_t kMaxFeedBytes = 32 * 1024 * 1024;
+
+struct Options {
+    std::string upstream = kUpstreamUrl;
+    std::string bind = "0.0.0.0";
+    uint16_t port = 8080;
+    unsigned refresh_seconds = 3600;
+    unsigned workers = 32;
+    std::string replay_dir;
+    double replay_speed = 1.0;
+};
+
+// One servable file, with its precomputed gzip variant. Strong validators
+// differ per content coding, so each representation has its own ETag.
+struct Resource {
+    std::string content_type;
+    std::string body;
+    std::string gzip;
+    std::string etag;
+    std::string gzip_etag;
+};
+
+using Catalog = std::map<std::string, Resource>;
+
+std::string gzipCompress(const std::string& data) {
+    z_stream stream{};
+    // 15 window bits plus 16 selects the gzip wrapper
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return {};
+    }
+    std::string out(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    int rc = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return rc == Z_STREAM_END ? out : std::string();
+}
+
+Resource makeResource(std::string content_type, std::string body) {
+    Resource resource;
+    FeedHash hash;
+    hash.update(body.data(), body.size());
+    resource.etag = "\"" + hash.hex() + "\"";
+    resource.gzip_etag = "\"" + hash.hex() + "-gzip\"";
+    resource.gzip = gzipCompress(body);
+    // Only keep the compressed variant when it is actually smaller
+    if (resource.gzip.size() >= body.size()) {
+        resource.gzip.clear();
+    }
+    resource.content_type = std::move(content_type);
+    resource.body = std::move(body);
+    return resource;
+}
+
+size_t writeCallback(char* data, size_t size, size_t nmemb, void* userp) {
+    auto* body = static_cast<std::string*>(userp);
+    size_t total = size * nmemb;
+    if (body->size() + total > kMaxFeedBytes) {
+        return 0;
+    }
+    body->append(data, total);
+    return total;
+}
+
+class Mirror {
+ public:
+    explicit Mirror(Options options) : options_(std::move(options)) {}
+
+    std::shared_ptr<const Catalog> catalog() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return catalog_;
+    }
+
+    // Fetch upstream and rebuild the catalog. Keeps the current catalog on
+    // any failure, and skips the rebuild on 304 Not Modified. Returns false
+    // when upstream gave nothing usable.
+    bool refresh() {
+        std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> curl(curl_easy_init(),
+                                                                 curl_easy_cleanup);
+        if (!curl) {
+            std::cerr << "Failed to initialize curl" << std::endl;
+            return false;
+        }
+
+        std::string body;
+        struct curl_slist* headers = nullptr;
+        if (!upstream_etag_.empty()) {
+            headers = curl_slist_append(headers, ("If-None-Match: " + upstream_etag_).c_str());
+        }
+        curl_easy_setopt(curl.get(), CURLOPT_URL, options_.upstream.c_str());
+        curl_easy_setopt(curl.get(), CURLOPT_USERAGENT, kUserAgent.c_str());
+        curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, writeCallback);
+        curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &body);
+        curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl.get(), CURLOPT_TIMEOUT, 60L);
+
+        CURLcode res = curl_easy_perform(curl.get());
+        long http_code = 0;
+        curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
+        struct curl_header* etag_header = nullptr;
+        std::string etag;
+        if (curl_easy_header(curl.get(), "ETag", 0, CURLH_HEADER, -1, &etag_header) ==
+            CURLHE_OK) {
+            etag = etag_header->value;
+        }
+        curl_slist_free_all(headers);
+
+        if (res != CURLE_OK) {
+            std::cerr << "Upstream fetch failed: " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+        if (http_code == 304) {
+            return true;
+        }
+        if (http_code != 200) {
+            std::cerr << "Upstream returned HTTP " << http_code << std::endl;
+            return false;
+        }
+
+        // parse() may pad the buffer in place, so index a copy
+        std::string scratch = body;
+        std::string error;
+        auto snapshot = SofaSnapshot::parse(scratch, error);
+        if (!snapshot) {
+            std::cerr << "Upstream feed rejected: " << error << std::endl;
+            return false;
+        }
+
+        auto catalog = std::make_shared<Catalog>();
+        (*catalog)["/v1/macos_data_feed.bin"] =
+            makeResource("application/octet-stream", snapshot->serialize());
+        (*catalog)["/v1/macos_data_feed.json"] = makeResource("application/json", std::move(body));
+        for (auto model : snapshot->modelIdentifiers()) {
+            (*catalog)["/v1/slices/" + std::string(model) + ".bin"] =
+                makeResource("application/octet-stream", snapshot->serializeModel(model));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        catalog_ = std::move(catalog);
+        upstream_etag_ = etag;
+        std::cerr << "Catalog refreshed, upstream ETag " << etag << std::endl;
+        return true;
+    }
+
+    // Refresh every --refresh seconds. Until the first catalog is built,
+    // every request gets a 503, so failures are retried sooner, backing off
+    // from kFirstRetry up to the refresh period.
+    void runRefresher() {
+        auto retry = kFirstRetry;
+        auto period = std::chrono::seconds(options_.refresh_seconds);
+        while (true) {
+            bool ok = refresh();
+            if (ok || catalog()) {
+                retry = kFirstRetry;
+                std::this_thread::sleep_for(period);
+                continue;
+            }
+            std::cerr << "No catalog yet, retrying in " << retry.count() << "s" << std::endl;
+            std::this_thread::sleep_for(retry);
+            retry = std::min(retry * 2, period);
+        }
+    }
+
+ private:
+    static constexpr std::chrono::seconds kFirstRetry{10};
+
+    Options options_;
+    std::mutex mutex_;
+    std::shared_ptr<const Catalog> catalog_;
+    std::string upstream_etag_;
+};
+
+// Minimal request view: method, path and the two headers we act on
+struct Request {
+    std::string method;
+    std::string path;
+    std::string if_none_match;
+    bool accepts_gzip = false;
+    bool keep_alive = true;
+};
+
+std::string lower(std::string value) {
+    for (auto& c : value) {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return value;
+}
+
+// Decode %XX escapes; model identifiers contain commas, which clients may escape
+std::string percentDecode(const std::string& path) {
+    std::string out;
+    out.reserve(path.size());
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] == '%' && i + 2 < path.size() &&
+            isxdigit(static_cast<unsigned char>(path[i + 1])) &&
+            isxdigit(static_cast<unsigned char>(path[i + 2]))) {
+            out.push_back(static_cast<char>(std::stoi(path.substr(i + 1, 2), nullptr, 16)));
+            i += 2;
+        } else {
+            out.push_back(path[i]);
+        }
+    }
+    return out;
+}
+
+bool parseRequest(const std::string& head, Request& request) {
+    size_t line_end = head.find("\r\n");
+    std::string line = head.substr(0, line_end);
+    size_t first = line.find(' ');
+    size_t second = line.find(' ', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+        return false;
+    }
+    request.method = line.substr(0, first);
+    request.path = line.substr(first + 1, second - first - 1);
+    request.keep_alive = line.substr(second + 1) != "HTTP/1.0";
+    size_t query = request.path.find('?');
+    if (query != std::string::npos) {
+        request.path.resize(query);
+    }
+    request.path = percentDecode(request.path);
+
+    size_t pos = line_end + 2;
+    while (pos < head.size()) {
+        size_t end = head.find("\r\n", pos);
+        if (end == std::string::npos || end == pos) {
+            break;
+        }
+        std::string header = head.substr(pos, end - pos);
+        pos = end + 2;
+        size_t colon = header.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = lower(header.substr(0, colon));
+        std::string value = header.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        if (name == "if-none-match") {
+            request.if_none_match = value;
+        } else if (name == "accept-encoding") {
+            request.accepts_gzip = lower(value).find("gzip") != std::string::npos;
+        } else if (name == "connection") {
+            std::string connection = lower(value);
+            if (connection == "close") {
+                request.keep_alive = false;
+            } else if (connection == "keep-alive") {
+                request.keep_alive = true;
+            }
+        }
+    }
+    return true;
+}
+
+// True if the If-None-Match list contains the tag (or "*")
+bool etagMatches(const std::string& if_none_match, const std::string& etag) {
+    if (if_none_match.empty()) {
+        return false;
+    }
+    if (if_none_match == "*") {
+        return true;
+    }
+    size_t pos = 0;
+    while (pos < if_none_match.size()) {
+        size_t comma = if_none_match.find(',', pos);
+        std::string tag = if_none_match.substr(pos, comma - pos);
+        tag.erase(0, tag.find_first_not_of(" \t"));
+        tag.erase(tag.find_last_not_of(" \t") + 1);
+        if (tag == etag) {
+            return true;
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return false;
+}
+
+// Fixtures served by --replay, by request path in recorded order
+class Replay {
+ public:
+    Replay(std::string dir, double speed) : dir_(std::move(dir)), speed_(speed) {}
+
+    // Read every *.fixture in the directory; false if none could be read
+    bool load() {
+        DIR* dir = opendir(dir_.c_str());
+        if (dir == nullptr) {
+            return false;
+        }
+        std::vector<std::string> names;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 8 && name.compare(name.size() - 8, 8, ".fixture") == 0) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+
+        for (const auto& name : names) {
+            std::ifstream file(dir_ + "/" + name, std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+            HttpFixture fixture;
+            if (!HttpFixture::decode(data, fixture)) {
+                std::cerr << "Skipping malformed fixture " << name << std::endl;
+                continue;
+            }
+            fixtures_[urlPath(fixture.url)].push_back(std::move(fixture));
+        }
+        return !fixtures_.empty();
+    }
+
+    // The fixture recorded for the same path and If-None-Match, else the
+    // latest unconditional one for the path, or nullptr
+    const HttpFixture* find(const Request& request) const {
+        auto it = fixtures_.find(request.path);
+        if (it == fixtures_.end()) {
+            return nullptr;
+        }
+        const HttpFixture* unconditional = nullptr;
+        for (auto f = it->second.rbegin(); f != it->second.rend(); ++f) {
+            if (!request.if_none_match.empty() && f->request_etag == request.if_none_match) {
+                return &*f;
+            }
+            if (unconditional == nullptr && f->request_etag.empty()) {
+                unconditional = &*f;
+            }
+        }
+        return unconditional;
+    }
+
+    // Recorded response time scaled by --replay-speed
+    std::chrono::microseconds delay(const HttpFixture& fixture) const {
+        return std::chrono::microseconds(static_cast<int64_t>(fixture.elapsed_ms * speed_ * 1000));
+    }
+
+ private:
+    static std::string urlPath(const std::string& url) {
+        size_t scheme = url.find("://");
+        size_t path = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+        if (path == std::string::npos) {
+            return "/";
+        }
+        return url.substr(path, url.find_first_of("?#", path) - path);
+    }
+
+    std::string dir_;
+    double speed_;
+    std::map<std::string, std::vector<HttpFixture>> fixtures_;
+};
+
+// Status line text for the codes fixtures may carry
+std::string statusText(long code) {
+    switch (code) {
+    case 200:
+        return "200 OK";
+    case 304:
+        return "304 Not Modified";
+    case 404:
+        return "404 Not Found";
+    case 500:
+        return "500 Internal Server Error";
+    case 503:
+        return "503 Service Unavailable";
+    default:
+        return std::to_string(code) + " Replayed";
+    }
+}
+
+bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Send the status line, headers and body; false when the connection is done
+bool sendResponse(int fd,
+                  const Request& request,
+                  const std::string& status,
+                  std::string headers,
+                  const std::string* body) {
+    // A 304 must not claim a zero-length representation
+    if (status != "304 Not Modified") {
+        headers += "Content-Length: " + std::to_string(body ? body->size() : 0) + "\r\n";
+    }
+    std::string head = "HTTP/1.1 " + status + "\r\n" + headers +
+                       (request.keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+    if (!sendAll(fd, head.data(), head.size())) {
+        return false;
+    }
+    if (body && request.method == "GET" && !sendAll(fd, body->data(), body->size())) {
+        return false;
+    }
+    return request.keep_alive;
+}
+
+bool respond(int fd, const Request& request, Mirror& mirror) {
+    std::string status = "200 OK";
+    std::string headers;
+    const std::string* body = nullptr;
+
+    auto catalog = mirror.catalog();
+    auto it = catalog ? catalog->find(request.path) : Catalog::const_iterator();
+    if (request.method != "GET" && request.method != "HEAD") {
+        status = "405 Method Not Allowed";
+        headers += "Allow: GET, HEAD\r\n";
+    } else if (!catalog) {
+        status = "503 Service Unavailable";
+        headers += "Retry-After: 30\r\n";
+    } else if (it == catalog->end()) {
+        status = "404 Not Found";
+    } else {
+        const Resource& resource = it->second;
+        bool gzip = request.accepts_gzip && !resource.gzip.empty();
+        const std::string& etag = gzip ? resource.gzip_etag : resource.etag;
+        headers += "ETag: " + etag + "\r\n";
+        headers += "Vary: Accept-Encoding\r\n";
+        headers += "Cache-Control: public, max-age=300\r\n";
+        if (etagMatches(request.if_none_match, etag)) {
+            status = "304 Not Modified";
+        } else {
+            headers += "Content-Type: " + resource.content_type + "\r\n";
+            if (gzip) {
+                headers += "Content-Encoding: gzip\r\n";
+                body = &resource.gzip;
+            } else {
+                body = &resource.body;
+            }
+        }
+    }
+
+    return sendResponse(fd, request, status, headers, body);
+}
+
+// Send the body of an endless fixture again and again, delimited by the
+// connection close, until the client hangs up
+bool sendEndless(int fd,
+                 const Request& request,
+                 const std::string& status,
+                 const std::string& headers,
+                 const std::string& body) {
+    std::string head = "HTTP/1.1 " + status + "\r\n" + headers + "Connection: close\r\n\r\n";
+    if (!sendAll(fd, head.data(), head.size()) || request.method != "GET" || body.empty()) {
+        return false;
+    }
+    while (sendAll(fd, body.data(), body.size())) {
+    }
+    return false;
+}
+
+// Answer a request from the replay fixtures
+bool respondReplay(int fd, const Request& request, const Replay& replay) {
+    std::string status = "404 Not Found";
+    std::string headers;
+    const std::string* body = nullptr;
+
+    const HttpFixture* fixture = nullptr;
+    if (request.method != "GET" && request.method != "HEAD") {
+        status = "405 Method Not Allowed";
+        headers += "Allow: GET, HEAD\r\n";
+    } else {
+        fixture = replay.find(request);
+    }
+    if (fixture) {
+        std::this_thread::sleep_for(replay.delay(*fixture));
+        status = statusText(fixture->status);
+        if (!fixture->etag.empty()) {
+            headers += "ETag: " + fixture->etag + "\r\n";
+        }
+        // An unconditional fixture whose ETag the client already has
+        if (fixture->request_etag.empty() && etagMatches(request.if_none_match, fixture->etag)) {
+            status = statusText(304);
+        } else if (fixture->status != 304) {
+            if (!fixture->content_type.empty()) {
+                headers += "Content-Type: " + fixture->content_type + "\r\n";
+            }
+            body = &fixture->body;
+        }
+    }
+    if (body && fixture->endless) {
+        return sendEndless(fd, request, status, headers, *body);
+    }
+    return sendResponse(fd, request, status, headers, body);
+}
+
+// Answers one parsed request; returns false when the connection is done
+using Handler = std::function<bool(int fd, const Request& request)>;
+
+// Serve requests on a connection until it closes. crowded() tells whether
+// other connections wait for a worker; an idle connection then gives its
+// worker up.
+void serveConnection(int fd, const Handler& handler, const std::function<bool()>& crowded) {
+    // Wake up every second to notice waiting connections
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    // A response goes out as a head and a body write. With Nagle's algorithm
+    // the body's last segment waits for the client's delayed ACK of the
+    // head, about 40 ms per request on a keep-alive connection.
+    int no_delay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+        size_t head_end;
+        int idle = 0;
+        while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (buffer.size() > kMaxRequestBytes) {
+                close(fd);
+                return;
+            }
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (++idle < kIdleSeconds && (!buffer.empty() || !crowded())) {
+                    continue;
+                }
+            }
+            if (got <= 0) {
+                close(fd);
+                return;
+            }
+            buffer.append(chunk, static_cast<size_t>(got));
+        }
+
+        // Request bodies are not expected; anything after the head is the
+        // next pipelined request
+        Request request;
+        bool ok = parseRequest(buffer.substr(0, head_end + 2), request);
+        buffer.erase(0, head_end + 4);
+        if (!ok) {
+            const char kBadRequest[] =
+                "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            sendAll(fd, kBadRequest, sizeof(kBadRequest) - 1);
+            break;
+        }
+        if (!handler(fd, request)) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+// A fixed set of worker threads serving accepted connections, so a burst of
+// clients cannot start an unbounded number of threads
+class ConnectionPool {
+ public:
+    ConnectionPool(unsigned workers, Handler handler) : handler_(std::move(handler)) {
+        for (unsigned i = 0; i < workers; i++) {
+            threads_.emplace_back([this] { run(); });
+        }
+    }
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    ~ConnectionPool() { stop(); }
+
+    // Close queued connections, let the workers finish the requests they
+    // are serving and drop idle keep-alive connections, and join them
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            for (int fd : queue_) {
+                close(fd);
+            }
+            queue_.clear();
+        }
+        ready_.notify_all();
+        for (auto& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    // Queue a connection for the next free worker; false when the queue is full
+    bool submit(int fd) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.size() >= kMaxQueuedConnections) {
+                return false;
+            }
+            queue_.push_back(fd);
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+ private:
+    void run() {
+        // Stopping counts as crowded, so idle connections are closed
+        auto crowded = [this] {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stopping_ || !queue_.empty();
+        };
+        while (true) {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                fd = queue_.front();
+                queue_.pop_front();
+            }
+            serveConnection(fd, handler_, crowded);
+        }
+    }
+
+    Handler handler_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<int> queue_;
+    bool stopping_ = false;
+    // Joined by stop(); the workers use this pool until they return
+    std::vector<std::thread> threads_;
+};
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0
+              << " [--bind ADDR] [--port N] [--upstream URL] [--refresh SECONDS]"
+              << " [--workers N] [--replay DIR] [--replay-speed FACTOR]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--bind") {
+            options.bind = value;
+        } else if (arg == "--port") {
+            options.port = static_cast<uint16_t>(std::strtoul(value.c_str(), nullptr, 10));
+        } else if (arg == "--upstream") {
+            options.upstream = value;
+        } else if (arg == "--refresh") {
+            options.refresh_seconds =
+                std::max(60UL, std::strtoul(value.c_str(), nullptr, 10));
+        } else if (arg == "--workers") {
+            options.workers = static_cast<unsigned>(
+                std::max(1UL, std::strtoul(value.c_str(), nullptr, 10)));
+        } else if (arg == "--replay") {
+            options.replay_dir = value;
+        } else if (arg == "--replay-speed") {
+            options.replay_speed = std::max(0.0, std::strtod(value.c_str(), nullptr));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.bind.c_str(), &addr.sin_addr) != 1 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listener, 128) != 0) {
+        std::cerr << "Cannot listen on " << options.bind << ":" << options.port << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    Mirror mirror(options);
+    Replay replay(options.replay_dir, options.replay_speed);
+    Handler handler;
+    if (!options.replay_dir.empty()) {
+        if (!replay.load()) {
+            std::cerr << "No fixtures in " << options.replay_dir << std::endl;
+            return 1;
+        }
+        handler = [&replay](int fd, const Request& request) {
+            return respondReplay(fd, request, replay);
+        };
+    } else {
+        std::thread([&mirror] { mirror.runRefresher(); }).detach();
+        handler = [&mirror](int fd, const Request& request) {
+            return respond(fd, request, mirror);
+        };
+    }
+
+    ConnectionPool pool(options.workers, handler);
+    std::cerr << "Serving on " << options.bind << ":" << options.port << " with "
+              << options.workers << " workers" << std::endl;
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "accept failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        if (!pool.submit(fd)) {
+            const char kBusy[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 5\r\n"
+                                 "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            sendAll(fd, kBusy, sizeof(kBusy) - 1);
+            close(fd);
+        }
+    }
+
+    pool.stop();
+    close(listener);
+    curl_global_cleanup();
+    return 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Minimal test harness: each test registers itself with TEST() and reports
+// failed CHECKs; main() runs them all and exits non-zero on any failure.
+
+namespace sofa_test {
+
+struct Case {
+    const char* name;
+    std::function<void()> run;
+};
+
+inline std::vector<Case>& cases() {
+    static std::vector<Case> registered;
+    return registered;
+}
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+struct Register {
+    Register(const char* name, std::function<void()> run) { cases().push_back({name, run}); }
+};
+
+// Runs every test and returns the process exit code
+inline int runAll() {
+    for (const auto& test : cases()) {
+        int before = failures();
+        test.run();
+        std::printf("%s %s\n", failures() == before ? "PASS" : "FAIL", test.name);
+    }
+    return failures() == 0 ? 0 : 1;
+}
+
+} // namespace sofa_test
+
+#define TEST(name)                                                   \
+    static void name();                                              \
+    static sofa_test::Register name##_registration(#name, name);     \
+    static void name()
+
+#define CHECK(condition)                                                      \
+    do {                                                                      \
+        if (!(condition)) {                                                   \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,      \
+                         __LINE__, #condition);                               \
+            sofa_test::failures()++;                                          \
+        }                                                                     \
+    } while (0)
+
+// CHECK with a description of the case, for checks inside loops
+#define CHECK_MSG(condition, message)                                         \
+    do {                                                                      \
+        if (!(condition)) {                                                   \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed: %s\n", __FILE__,  \
+                         __LINE__, #condition, std::string(message).c_str()); \
+            sofa_test::failures()++;                                          \
+        }                                                                     \
+    } while (0)
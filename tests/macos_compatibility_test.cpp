@@ -0,0 +1,988 @@
+// Tests for the extension: its tables evaluated against an in-memory feed
+// source instead of the network, cache and host, and the feed engine
+// against sofa_mirror --replay.
+//
+// Usage: macos_compatibility_test FIXTURE_DIR [SOFA_MIRROR]
+
+#include "check.h"
+
+// The tables are templates private to the extension's translation unit
+#include "../src/macos_compatibility.cpp"
+
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+using namespace osquery;
+
+static std::string fixture_dir = "tests/fixtures";
+static std::string mirror_path;
+
+// Serves fixed snapshots and host facts; set them before generating
+struct MemorySource {
+    static std::shared_ptr<const SofaSnapshot> macos;
+    static std::shared_ptr<const SofaSnapshot> ios;
+    static std::shared_ptr<const HostFacts> facts;
+    static BundleVersions bundles;
+
+    static std::shared_ptr<const SofaSnapshot> snapshot(FeedId id,
+                                                        const std::string&,
+                                                        std::string&) {
+        return id == FeedId::kMacOS ? macos : ios;
+    }
+
+    static uint64_t downloadBytes(FeedId) { return 0; }
+    static uint64_t downloadBytesTotal(FeedId) { return 0; }
+    static std::shared_ptr<const HostFacts> hostFacts() { return facts; }
+    static BundleVersions bundleVersions(const std::vector<std::string>&) { return bundles; }
+};
+
+std::shared_ptr<const SofaSnapshot> MemorySource::macos;
+std::shared_ptr<const SofaSnapshot> MemorySource::ios;
+std::shared_ptr<const HostFacts> MemorySource::facts;
+BundleVersions MemorySource::bundles;
+
+// A mkdtemp directory, removed with everything in it when the test ends
+class TempDir {
+ public:
+    TempDir() {
+        char dir_template[] = "/tmp/sofa_test.XXXXXX";
+        if (mkdtemp(dir_template) != nullptr) {
+            path_ = dir_template;
+        }
+    }
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+
+    ~TempDir() {
+        if (!path_.empty()) {
+            nftw(path_.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+
+    const std::string& path() const { return path_; }
+
+ private:
+    static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+        remove(path);
+        return 0;
+    }
+
+    std::string path_;
+};
+
+// Serves a directory of fixtures with sofa_mirror --replay on a free local
+// port while it lives
+class ReplayServer {
+ public:
+    // speed scales the recorded response times, 0 answers at once
+    explicit ReplayServer(const std::string& dir, const std::string& speed = "0") {
+        port_ = freePort();
+        pid_ = fork();
+        if (pid_ == 0) {
+#ifdef __linux__
+            // Do not outlive a test that crashed or timed out
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            std::string port = std::to_string(port_);
+            execl(mirror_path.c_str(), mirror_path.c_str(), "--bind", "127.0.0.1", "--port",
+                  port.c_str(), "--replay", dir.c_str(), "--replay-speed", speed.c_str(), nullptr);
+            _exit(127);
+        }
+        for (int i = 0; i < 100 && !accepting(); i++) {
+            usleep(50 * 1000);
+        }
+    }
+    ReplayServer(const ReplayServer&) = delete;
+    ReplayServer& operator=(const ReplayServer&) = delete;
+
+    ~ReplayServer() {
+        if (pid_ > 0) {
+            kill(pid_, SIGTERM);
+            waitpid(pid_, nullptr, 0);
+        }
+    }
+
+    std::string url(const std::string& path) const {
+        return "http://127.0.0.1:" + std::to_string(port_) + path;
+    }
+
+    bool running() const { return pid_ > 0 && waitpid(pid_, nullptr, WNOHANG) == 0; }
+
+    // A local port nothing listens on at the moment
+    static uint16_t freePort() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t size = sizeof(addr);
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &size);
+        close(fd);
+        return ntohs(addr.sin_port);
+    }
+
+ private:
+    bool accepting() const {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port_);
+        bool connected = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        close(fd);
+        return connected;
+    }
+
+    uint16_t port_ = 0;
+    pid_t pid_ = -1;
+};
+
+static std::string readText(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+static void writeFile(const std::string& path, const std::string& content) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << content;
+}
+
+static std::shared_ptr<const SofaSnapshot> readFixture(const std::string& name) {
+    std::ifstream in(fixture_dir + "/" + name, std::ios::binary);
+    std::string error;
+    auto snapshot = SofaSnapshot::read(in, error);
+    CHECK_MSG(snapshot != nullptr, name + ": " + error);
+    return snapshot;
+}
+
+static std::shared_ptr<const HostFacts> makeFacts(const std::string& version,
+                                                  const std::string& model) {
+    auto facts = std::make_shared<HostFacts>();
+    facts->system_version = version;
+    facts->system_os_major = version.substr(0, version.find('.'));
+    facts->model_identifier = model;
+    return facts;
+}
+
+static std::string column(const TableRows& rows, size_t row, const std::string& name) {
+    return static_cast<DynamicTableRow&>(*rows[row])[name];
+}
+
+// Size of the real macOS feed, give or take
+static constexpr uint64_t kRealisticFeedBytes = 12 * 1024 * 1024;
+
+// What a low-memory refresh may raise the peak RSS by, as a share of the feed
+static constexpr uint64_t kLowMemoryBudgetDivisor = 4;
+
+// Write a replay fixture answering url with the macOS fixture feed padded to
+// about size bytes, and return the body's size. The padding goes into the
+// SecurityReleases' CVEs maps, which the index only skips over, as in the
+// real feed. The body is written piecewise so the test never holds it.
+static uint64_t writeLargeFeedFixture(const std::string& path,
+                                      const std::string& url,
+                                      uint64_t size) {
+    auto feed = nlohmann::json::parse(readText(fixture_dir + "/macos_data_feed.json"));
+    size_t releases = 0;
+    for (const auto& os : feed["OSVersions"]) {
+        releases += os["SecurityReleases"].size();
+    }
+    // "CVE-2024-0000001":false, is 24 bytes
+    uint64_t per_release = size / std::max<size_t>(releases, 1) / 24;
+
+    std::string body_path = path + ".body";
+    {
+        std::ofstream body(body_path, std::ios::binary | std::ios::trunc);
+        uint64_t next_cve = 0;
+        body << "{";
+        bool first = true;
+        for (const auto& item : feed.items()) {
+            body << (first ? "" : ",") << nlohmann::json(item.key()).dump() << ":";
+            first = false;
+            if (item.key() != "OSVersions") {
+                body << item.value().dump();
+                continue;
+            }
+            body << "[";
+            for (size_t i = 0; i < item.value().size(); i++) {
+                auto os = item.value()[i];
+                auto updates = os["SecurityReleases"];
+                os.erase("SecurityReleases");
+                std::string head = os.dump();
+                head.pop_back();
+                body << (i > 0 ? "," : "") << head << (os.empty() ? "" : ",")
+                     << "\"SecurityReleases\":[";
+                for (size_t j = 0; j < updates.size(); j++) {
+                    auto update = updates[j];
+                    update.erase("CVEs");
+                    std::string fields = update.dump();
+                    fields.pop_back();
+                    body << (j > 0 ? "," : "") << fields << (update.empty() ? "" : ",")
+                         << "\"CVEs\":{";
+                    for (uint64_t k = 0; k < per_release; k++) {
+                        char cve[32];
+                        snprintf(cve, sizeof(cve), "%s\"CVE-2024-%07llu\":false", k > 0 ? "," : "",
+                                 static_cast<unsigned long long>(next_cve++ % 10000000));
+                        body << cve;
+                    }
+                    body << "}}";
+                }
+                body << "]}";
+            }
+            body << "]";
+        }
+        body << "}";
+    }
+
+    HttpFixture fixture;
+    fixture.url = url;
+    fixture.status = 200;
+    fixture.etag = "\"large\"";
+    fixture.content_type = "application/json";
+    uint64_t body_size = static_cast<uint64_t>(FileIdentity::of(body_path).size);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << fixture.encodeHead(body_size);
+    std::ifstream in(body_path, std::ios::binary);
+    out << in.rdbuf();
+    unlink(body_path.c_str());
+    return body_size;
+}
+
+// A low-memory refresh of a feed the size of the real one streams the body
+// through FeedDownload's parser pipe into the cache file without holding
+// it. A regular refresh of the same feed keeps the body, which shows the
+// measurement sees a feed's worth of memory. Defined first, so it runs
+// before other tests raise the peak RSS it measures against.
+TEST(lowMemoryRefreshStaysInBudget) {
+    if (mirror_path.empty()) {
+        std::printf("no sofa_mirror given, skipping\n");
+        return;
+    }
+    TempDir temp;
+    std::string dir = temp.path();
+    std::string replay_dir = dir + "/replay";
+    mkdir(replay_dir.c_str(), 0755);
+    std::string fixture_path = replay_dir + "/large.fixture";
+    uint64_t feed_bytes = writeLargeFeedFixture(
+        fixture_path, "http://sofa/v1/macos_data_feed.json", kRealisticFeedBytes);
+    CHECK(feed_bytes > kRealisticFeedBytes / 2);
+
+    ReplayServer server(replay_dir);
+    CHECK(server.running());
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    // Peak RSS growth over one refresh through FeedDownload
+    auto refresh = [&](bool low_memory, const std::string& cache_path) {
+        FLAGS_macos_compatibility_low_memory = low_memory;
+        uint64_t before = getResourceUsage().peak_rss_bytes;
+        {
+            FeedTransfer transfer(server.url("/v1/macos_data_feed.json"), "", kUserAgent,
+                                  cache_path, false);
+            CURLcode result = curl_easy_perform(transfer.handle());
+            CHECK_MSG(transfer.complete(result), transfer.parseError());
+            auto snapshot = transfer.snapshot();
+            CHECK(snapshot != nullptr && !snapshot->modelIdentifiers().empty());
+        }
+        FLAGS_macos_compatibility_low_memory = false;
+        return getResourceUsage().peak_rss_bytes - before;
+    };
+
+    std::string cache_path = dir + "/macos_data_feed.json";
+    uint64_t low_memory_growth = refresh(true, cache_path);
+    uint64_t regular_growth = refresh(false, dir + "/regular.json");
+    std::printf("%llu KiB feed raised peak RSS by %llu KiB in low-memory mode, %llu KiB "
+                "otherwise\n",
+                static_cast<unsigned long long>(feed_bytes / 1024),
+                static_cast<unsigned long long>(low_memory_growth / 1024),
+                static_cast<unsigned long long>(regular_growth / 1024));
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+    // The body is kept whole and left to the cache writer
+    std::printf("simdjson parses the whole body, skipping the low-memory budget\n");
+#else
+    CHECK(low_memory_growth < feed_bytes / kLowMemoryBudgetDivisor);
+    // The body went straight into the cache file
+    CHECK(static_cast<uint64_t>(FileIdentity::of(cache_path).size) == feed_bytes);
+#endif
+    CHECK(regular_growth > feed_bytes / 2);
+
+}
+
+// curl may call the write callback with no data; the reader must not see
+// anything for it
+TEST(chunkPipeSkipsEmptyChunks) {
+    std::string feed = readText(fixture_dir + "/macos_data_feed.json");
+    ChunkPipe pipe;
+    pipe.push(feed.data(), feed.size() / 2);
+    pipe.push(feed.data(), 0);
+    pipe.push(feed.data() + feed.size() / 2, feed.size() - feed.size() / 2);
+    pipe.close();
+    std::istream in(&pipe);
+    std::string error;
+    CHECK_MSG(SofaSnapshot::read(in, error) != nullptr, error);
+}
+
+TEST(compatibilityFromMemory) {
+    MemorySource::macos = readFixture("macos_data_feed.json");
+    MemorySource::facts = makeFacts("14.5", "Macmini9,1");
+    if (MemorySource::macos == nullptr) {
+        return;
+    }
+
+    BasicMacOSCompatibilityTable<MemorySource> table;
+    QueryContext context;
+    auto rows = table.generate(context);
+    CHECK(rows.size() == 1);
+    if (rows.size() != 1) {
+        return;
+    }
+    std::string latest(MemorySource::macos->latestOs());
+    CHECK(column(rows, 0, "system_version") == "14.5");
+    CHECK(column(rows, 0, "model_identifier") == "Macmini9,1");
+    CHECK(column(rows, 0, "latest_macos") == latest);
+    CHECK(column(rows, 0, "latest_compatible_macos") == latest);
+    CHECK(column(rows, 0, "is_compatible") == "1");
+    CHECK(!column(rows, 0, "rss_bytes").empty());
+    CHECK(table.renders() == 1);
+
+    // The same snapshot and host facts reuse the memoized row
+    rows = table.generate(context);
+    CHECK(rows.size() == 1 && column(rows, 0, "latest_macos") == latest);
+    CHECK(!column(rows, 0, "rss_bytes").empty());
+    CHECK(table.renders() == 1);
+
+    // New host facts are a new object and render a new row
+    MemorySource::facts = makeFacts("15.0", "Macmini9,1");
+    rows = table.generate(context);
+    CHECK(rows.size() == 1 && column(rows, 0, "system_version") == "15.0");
+    CHECK(table.renders() == 2);
+
+    // So does a new snapshot
+    MemorySource::macos = readFixture("macos_data_feed.json");
+    rows = table.generate(context);
+    CHECK(table.renders() == 3);
+}
+
+TEST(compatibilityWithoutData) {
+    BasicMacOSCompatibilityTable<MemorySource> table;
+    QueryContext context;
+
+    MemorySource::macos = nullptr;
+    MemorySource::facts = makeFacts("14.5", "Macmini9,1");
+    auto rows = table.generate(context);
+    CHECK(rows.size() == 1);
+    if (rows.size() == 1) {
+        CHECK(column(rows, 0, "is_compatible") == "-1");
+        CHECK(column(rows, 0, "status") == "Could not obtain data");
+    }
+
+    // Without host facts there is nothing to score
+    MemorySource::facts = nullptr;
+    CHECK(table.generate(context).empty());
+}
+
+TEST(upgradeOptionsFromMemory) {
+    MemorySource::macos = readFixture("macos_data_feed.json");
+    MemorySource::facts = makeFacts("13.0", "Macmini9,1");
+    if (MemorySource::macos == nullptr) {
+        return;
+    }
+
+    BasicMacOSUpgradeOptionsTable<MemorySource> table;
+    QueryContext context;
+    auto rows = table.generate(context);
+    CHECK(!rows.empty());
+    size_t latest = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+        CHECK(column(rows, i, "model_identifier") == "Macmini9,1");
+        CHECK(column(rows, i, "target_version") != "13.0");
+        CHECK(std::stoll(column(rows, i, "cve_count")) >= 0);
+        latest += column(rows, i, "is_latest") == "1" ? 1 : 0;
+    }
+    CHECK(latest == 1);
+}
+
+// product_type and product_version are pushed down from the WHERE clause:
+// each requested type is scored against each requested version, and a
+// type the feed does not know is reported as unsupported.
+TEST(iosCompatibilityFromMemory) {
+    MemorySource::ios = readFixture("ios_data_feed.json");
+    if (MemorySource::ios == nullptr) {
+        return;
+    }
+
+    BasicIOSCompatibilityTable<MemorySource> table;
+    QueryContext context;
+    for (const auto* type : {"iPhone16,2", "iPhone10,3", "iPhone1,1"}) {
+        context.constraints["product_type"].add(Constraint(EQUALS, type));
+    }
+    for (const auto* version : {"17.7.6", "18.4.1"}) {
+        context.constraints["product_version"].add(Constraint(EQUALS, version));
+    }
+    auto rows = table.generate(context);
+    CHECK(rows.size() == 6);
+
+    // type -> version -> {latest_compatible_version, is_up_to_date, status}
+    std::map<std::string, std::map<std::string, std::vector<std::string>>> found;
+    for (size_t i = 0; i < rows.size(); i++) {
+        CHECK(column(rows, i, "latest_ios") == "18");
+        CHECK(column(rows, i, "latest_version") == "18.4.1");
+        found[column(rows, i, "product_type")][column(rows, i, "product_version")] = {
+            column(rows, i, "latest_compatible_version"), column(rows, i, "is_up_to_date"),
+            column(rows, i, "status")};
+    }
+    using Expected = std::vector<std::string>;
+    // Runs the latest iOS: up to date only on its newest build
+    CHECK((found["iPhone16,2"]["17.7.6"] == Expected{"18.4.1", "0", "Pass"}));
+    CHECK((found["iPhone16,2"]["18.4.1"] == Expected{"18.4.1", "1", "Pass"}));
+    // Stuck on iOS 17: its newest build is current for it
+    CHECK((found["iPhone10,3"]["17.7.6"] == Expected{"17.7.6", "1", "Fail"}));
+    CHECK((found["iPhone10,3"]["18.4.1"] == Expected{"17.7.6", "1", "Fail"}));
+    // Not in the feed
+    CHECK((found["iPhone1,1"]["17.7.6"] == Expected{"", "-1", "Unsupported Hardware"}));
+    CHECK((found["iPhone1,1"]["18.4.1"] == Expected{"", "-1", "Unsupported Hardware"}));
+
+    // Without constraints every device in the feed is listed once, with no
+    // version to compare
+    QueryContext all;
+    rows = table.generate(all);
+    CHECK(rows.size() == MemorySource::ios->modelIdentifiers().size());
+    for (size_t i = 0; i < rows.size(); i++) {
+        CHECK(column(rows, i, "product_version").empty());
+        CHECK(column(rows, i, "is_up_to_date") == "-1");
+        CHECK(column(rows, i, "status") != "Unsupported Hardware");
+    }
+}
+
+// Installed XProtect bundles against the feed, compared part by part so a
+// missing trailing part counts as zero
+TEST(xprotectFreshnessFromMemory) {
+    const std::string xprotect =
+        "/Library/Apple/System/Library/CoreServices/XProtect.app/Contents/Info.plist";
+    const std::string plugin_service =
+        "/Library/Apple/System/Library/CoreServices/XProtect.app/Contents/XPCServices/"
+        "XProtectPluginService.xpc/Contents/Info.plist";
+    const std::string config_data =
+        "/Library/Apple/System/Library/CoreServices/XProtect.bundle/Contents/Info.plist";
+
+    auto feed = nlohmann::json::parse(readText(fixture_dir + "/macos_data_feed.json"));
+    feed["XProtectPayloads"]["com.apple.XProtectFramework.XProtect"] = "5290.1";
+    feed["XProtectPayloads"]["com.apple.XprotectFramework.PluginService"] = "80";
+    feed["XProtectPlistConfigData"]["com.apple.XProtect"] = "5290";
+    std::istringstream in(feed.dump());
+    std::string error;
+    MemorySource::macos = SofaSnapshot::read(in, error);
+    CHECK_MSG(MemorySource::macos != nullptr, error);
+    if (MemorySource::macos == nullptr) {
+        return;
+    }
+
+    BasicXProtectFreshnessTable<MemorySource> table;
+    QueryContext context;
+    auto statuses = [&] {
+        std::map<std::string, std::pair<std::string, std::string>> found;
+        auto rows = table.generate(context);
+        CHECK(rows.size() == 3);
+        for (size_t i = 0; i < rows.size(); i++) {
+            found[column(rows, i, "component")] = {column(rows, i, "is_current"),
+                                                   column(rows, i, "status")};
+        }
+        return found;
+    };
+    using Status = std::pair<std::string, std::string>;
+    const Status current{"1", "Current"};
+    const Status outdated{"0", "Outdated"};
+
+    // 5290 is older than 5290.1, 5290.1 is newer than 5290, and the
+    // PluginService plist is missing
+    MemorySource::bundles = {{xprotect, "5290"}, {config_data, "5290.1"}};
+    auto found = statuses();
+    CHECK(found["com.apple.XProtectFramework.XProtect"] == outdated);
+    CHECK(found["com.apple.XProtect"] == current);
+    CHECK((found["com.apple.XprotectFramework.PluginService"] == Status{"-1", "Not Installed"}));
+
+    // Equal after padding with zeros, and a newer major part wins over
+    // more parts
+    MemorySource::bundles = {{xprotect, "5290.1.0"}, {config_data, "5290.0"},
+                             {plugin_service, "79.9"}};
+    found = statuses();
+    CHECK(found["com.apple.XProtectFramework.XProtect"] == current);
+    CHECK(found["com.apple.XProtect"] == current);
+    CHECK(found["com.apple.XprotectFramework.PluginService"] == outdated);
+
+    MemorySource::bundles = {{xprotect, "5291"}, {config_data, "5289.9"},
+                             {plugin_service, "80"}};
+    found = statuses();
+    CHECK(found["com.apple.XProtectFramework.XProtect"] == current);
+    CHECK(found["com.apple.XProtect"] == outdated);
+    CHECK(found["com.apple.XprotectFramework.PluginService"] == current);
+    MemorySource::bundles.clear();
+}
+
+// Feeds in the osquery config: the JSON object inline or a base64 compact
+// index. A section that does not parse is reported and keeps the feed from
+// before.
+TEST(configFeedsFromInlineJsonAndIndex) {
+    ConfigFeeds feeds;
+    std::string macos_text = readText(fixture_dir + "/macos_data_feed.json");
+    auto ios = readFixture("ios_data_feed.json");
+    CHECK(ios != nullptr);
+    if (ios == nullptr) {
+        return;
+    }
+    nlohmann::json config = {{kConfigMacOSFeedKey, nlohmann::json::parse(macos_text)},
+                             {kConfigIOSFeedKey, base64::encode(ios->serialize())}};
+    feeds.update("test", config.dump());
+
+    std::string error;
+    auto macos = feeds.get(kConfigMacOSFeedKey, std::chrono::milliseconds(0), error);
+    CHECK_MSG(macos != nullptr && macos->latestOs() == "Sequoia 15", error);
+    auto decoded = feeds.get(kConfigIOSFeedKey, std::chrono::milliseconds(0), error);
+    CHECK_MSG(decoded != nullptr && decoded->serialize() == ios->serialize(), error);
+
+    // Malformed sections are ignored, the earlier snapshots stay
+    for (const auto& bad : {nlohmann::json{{kConfigMacOSFeedKey, {{"OSVersions", "none"}}}},
+                            nlohmann::json{{kConfigMacOSFeedKey, "not an index"}},
+                            nlohmann::json{{kConfigMacOSFeedKey, 42}}}) {
+        feeds.update("test", bad.dump());
+        CHECK_MSG(feeds.get(kConfigMacOSFeedKey, std::chrono::milliseconds(0), error) == macos,
+                  bad.dump());
+        CHECK_MSG(!error.empty(), bad.dump());
+    }
+    feeds.update("test", "not json");
+    CHECK(feeds.get(kConfigMacOSFeedKey) == macos);
+    CHECK(feeds.get(kConfigIOSFeedKey) == decoded);
+}
+
+// Only the feed's own stale temporary files are swept from the cache
+// directory it shares with other SOFA consumers
+TEST(staleTempFilesOfOtherConsumersAreKept) {
+    TempDir temp;
+    std::string dir = temp.path();
+    const std::vector<std::string> own = {
+        "macos_data_feed.json.tmp.a1B2c3",
+        "macos_data_feed_etag.txt.tmp.000000",
+        "macos_data_feed.bin.tmp.q1w2e3",
+        "macos_data_feed_bin_hash.txt.tmp.zZ9x00",
+        "macos_data_feed_Mac14_2.bin.tmp.abcdef",
+    };
+    const std::vector<std::string> foreign = {
+        "macos_data_feed.json.tmp",
+        "macos_data_feed.json.tmp.1",
+        "macos_data_feed.json.tmp.a1B2c3.part",
+        "macos_data_feed.plist.tmp.a1B2c3",
+        "macos_data_feed_x.json.tmp.a1B2c3",
+        "other_feed.json.tmp.a1B2c3",
+        "notes.tmp",
+    };
+    // Old enough to be stale, apart from one file of our own
+    struct timeval old_times[2] = {{std::time(nullptr) - 2 * kStaleTempSeconds, 0},
+                                   {std::time(nullptr) - 2 * kStaleTempSeconds, 0}};
+    for (const auto& name : own) {
+        CHECK_MSG(isOwnTempFile(name, "macos_data_feed"), name);
+    }
+    for (const auto& name : foreign) {
+        CHECK_MSG(!isOwnTempFile(name, "macos_data_feed"), name);
+    }
+    for (const auto& names : {own, foreign}) {
+        for (const auto& name : names) {
+            std::string path = dir + "/" + name;
+            writeFile(path, "x");
+            utimes(path.c_str(), old_times);
+        }
+    }
+    std::string young = dir + "/macos_data_feed.json.tmp.young1";
+    writeFile(young, "x");
+
+    removeStaleTempFiles(dir, "macos_data_feed");
+    for (const auto& name : own) {
+        CHECK_MSG(access((dir + "/" + name).c_str(), F_OK) != 0, name);
+    }
+    for (const auto& name : foreign) {
+        CHECK_MSG(access((dir + "/" + name).c_str(), F_OK) == 0, name);
+    }
+    CHECK(access(young.c_str(), F_OK) == 0);
+}
+
+// Run one refresh of feed to its end, driving curl the way the engine
+// thread does. Returns whether a source answered.
+static bool refreshOnce(SofaFeed& feed) {
+    using Clock = std::chrono::steady_clock;
+    CURLM* multi = curl_multi_init();
+    bool fresh = false;
+    {
+        RefreshJob job(feed, multi);
+        auto deadline = Clock::now() + std::chrono::seconds(30);
+        while (!job.done() && Clock::now() < deadline) {
+            job.launchDue(Clock::now());
+            int running = 0;
+            curl_multi_perform(multi, &running);
+            int queued = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+                if (msg->msg == CURLMSG_DONE) {
+                    job.onDone(msg->easy_handle, msg->data.result);
+                }
+            }
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(job.nextDue() -
+                                                                              Clock::now());
+            curl_multi_poll(multi, nullptr, 0,
+                            static_cast<int>(std::clamp<int64_t>(wait.count(), 0, 50)), nullptr);
+        }
+        fresh = job.done() && job.fresh();
+    }
+    curl_multi_cleanup(multi);
+    return fresh;
+}
+
+// A refresh answered by upstream reports that stage and the URL that
+// answered in the feed's health, not the flags it was configured with
+TEST(healthReportsTheSourceThatAnswered) {
+    if (mirror_path.empty()) {
+        std::printf("no sofa_mirror given, skipping\n");
+        return;
+    }
+    TempDir temp;
+    std::string dir = temp.path();
+    std::string cache_dir = dir + "/cache";
+    std::string replay_dir = dir + "/replay";
+    mkdir(cache_dir.c_str(), 0755);
+    mkdir(replay_dir.c_str(), 0755);
+
+    HttpFixture fixture;
+    fixture.url = "http://sofa/v1/macos_data_feed.json";
+    fixture.status = 200;
+    fixture.etag = "\"answered\"";
+    fixture.content_type = "application/json";
+    fixture.body = readText(fixture_dir + "/macos_data_feed.json");
+    writeFile(replay_dir + "/feed.fixture", fixture.encode());
+
+    ReplayServer server(replay_dir);
+    CHECK(server.running());
+    std::string url = server.url("/v1/macos_data_feed.json");
+    FLAGS_macos_compatibility_cache_dir = cache_dir;
+
+    CacheWriter writer;
+    SofaFeed feed(FeedSpec{"macos", "macos_data_feed",
+                           [url] { return std::vector<std::string>{url}; }, false},
+                  writer, [] {});
+    CHECK(refreshOnce(feed));
+    // As the engine does: the writer's callbacks reach into the feed
+    writer.stop();
+
+    auto health = feed.health();
+    CHECK(health.loaded);
+    CHECK(health.source == "upstream");
+    CHECK(health.source_url == url);
+}
+
+// Two mirrors serve the same feed, one answering at once and one after
+// 800 ms. Requests go to the URL with the lower median first, the next URL
+// is asked once the first has been waiting for its p95, and the loser of a
+// hedged pair is cancelled with its wait recorded as a lower bound.
+TEST(hedgedRequestsFollowLatency) {
+    if (mirror_path.empty()) {
+        std::printf("no sofa_mirror given, skipping\n");
+        return;
+    }
+    using Clock = std::chrono::steady_clock;
+    TempDir temp;
+    std::string dir = temp.path();
+    std::string cache_dir = dir + "/cache";
+    std::string replay_dir = dir + "/replay";
+    mkdir(cache_dir.c_str(), 0755);
+    mkdir(replay_dir.c_str(), 0755);
+
+    HttpFixture fixture;
+    fixture.url = "http://sofa/v1/macos_data_feed.json";
+    fixture.status = 200;
+    fixture.elapsed_ms = 800;
+    fixture.etag = "\"hedged\"";
+    fixture.content_type = "application/json";
+    fixture.body = readText(fixture_dir + "/macos_data_feed.json");
+    writeFile(replay_dir + "/feed.fixture", fixture.encode());
+
+    ReplayServer slow_server(replay_dir, "1");
+    ReplayServer fast_server(replay_dir, "0");
+    CHECK(slow_server.running() && fast_server.running());
+    std::string slow = slow_server.url("/v1/macos_data_feed.json");
+    std::string fast = fast_server.url("/v1/macos_data_feed.json");
+    FLAGS_macos_compatibility_cache_dir = cache_dir;
+
+    CacheWriter writer;
+    SofaFeed feed(FeedSpec{"macos", "macos_data_feed",
+                           [&] { return std::vector<std::string>{slow, fast}; }, false},
+                  writer, [] {});
+    auto elapsedMs = [](Clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    };
+
+    // The slow mirror has looked fast so far and goes first; the fast one is
+    // unmeasured. The hedge to it is due at the slow one's p95 of 100 ms.
+    for (int i = 0; i < 10; i++) {
+        feed.latency().record(slow, 100);
+    }
+    auto start = Clock::now();
+    CHECK(refreshOnce(feed));
+    double elapsed = elapsedMs(start);
+    CHECK_MSG(elapsed >= 100 && elapsed < 600, std::to_string(elapsed));
+    CHECK(feed.counter(SofaFeed::kHedged) == 1);
+    CHECK(feed.counter(SofaFeed::kFailedRequests) == 0);
+    CHECK(feed.health().source_url == fast);
+    // The cancelled request's wait raised the slow mirror's estimate
+    CHECK(feed.latency().percentile(slow, 1.0, 0) > 100);
+    CHECK(feed.latency().percentile(fast, 0.5, -1) >= 0);
+
+    // Once the medians show it, the fast mirror is asked first, although
+    // it is listed second, and answers before any hedge is due
+    for (int i = 0; i < 20; i++) {
+        feed.latency().record(slow, 800);
+        feed.latency().record(fast, 300);
+    }
+    CHECK((feed.latency().order({slow, fast}) == std::vector<std::string>{fast, slow}));
+    start = Clock::now();
+    CHECK(refreshOnce(feed));
+    elapsed = elapsedMs(start);
+    CHECK_MSG(elapsed < 300, std::to_string(elapsed));
+    CHECK(feed.counter(SofaFeed::kHedged) == 1);
+    CHECK(feed.health().source_url == fast);
+    writer.stop();
+}
+
+// A cache that fails its integrity check is moved aside along with its
+// etag, so the refresh asks upstream unconditionally and replaces it
+TEST(corruptCacheIsQuarantined) {
+    if (mirror_path.empty()) {
+        std::printf("no sofa_mirror given, skipping\n");
+        return;
+    }
+    TempDir temp;
+    std::string dir = temp.path();
+    std::string cache_dir = dir + "/cache";
+    std::string replay_dir = dir + "/replay";
+    mkdir(cache_dir.c_str(), 0755);
+    mkdir(replay_dir.c_str(), 0755);
+
+    // A torn cache: half the feed, with the etag and the hash of all of it
+    std::string feed_text = readText(fixture_dir + "/macos_data_feed.json");
+    std::string cache = cache_dir + "/macos_data_feed.json";
+    writeFile(cache, feed_text.substr(0, feed_text.size() / 2));
+    writeFile(cache_dir + "/macos_data_feed_etag.txt", "\"stale\"");
+    FeedHash hash;
+    hash.update(feed_text.data(), feed_text.size());
+    writeFile(cache_dir + "/macos_data_feed_hash.txt", hash.hex());
+
+    // Which fixture answers tells whether the request sent If-None-Match
+    HttpFixture fresh;
+    fresh.url = "http://sofa/v1/macos_data_feed.json";
+    fresh.status = 200;
+    fresh.etag = "\"fresh\"";
+    fresh.content_type = "application/json";
+    fresh.body = feed_text;
+    writeFile(replay_dir + "/fresh.fixture", fresh.encode());
+    HttpFixture conditional = fresh;
+    conditional.request_etag = "\"stale\"";
+    conditional.etag = "\"conditional\"";
+    writeFile(replay_dir + "/conditional.fixture", conditional.encode());
+
+    ReplayServer server(replay_dir);
+    CHECK(server.running());
+    std::string url = server.url("/v1/macos_data_feed.json");
+    FLAGS_macos_compatibility_cache_dir = cache_dir;
+
+    CacheWriter writer;
+    SofaFeed feed(FeedSpec{"macos", "macos_data_feed",
+                           [url] { return std::vector<std::string>{url}; }, false},
+                  writer, [] {});
+    CHECK(refreshOnce(feed));
+    writer.stop();
+
+    auto health = feed.health();
+    CHECK(health.quarantined == 1);
+    CHECK(health.loaded);
+    CHECK(readText(cache + ".corrupt") == feed_text.substr(0, feed_text.size() / 2));
+    CHECK(readText(cache_dir + "/macos_data_feed_etag.txt") == "\"fresh\"");
+    CHECK(readText(cache) == feed_text);
+}
+
+// A cache written before hashes were kept gets one through the cache
+// writer: a mkstemp temporary renamed into place, nothing left behind
+TEST(missingCacheHashIsBackfilled) {
+    TempDir temp;
+    std::string cache_dir = temp.path();
+    std::string cache = cache_dir + "/macos_data_feed.json";
+    writeFile(cache, readText(fixture_dir + "/macos_data_feed.json"));
+    FLAGS_macos_compatibility_cache_dir = cache_dir;
+
+    // Nothing listens there, so the refresh falls back to the cache
+    std::string url = "http://127.0.0.1:" + std::to_string(ReplayServer::freePort()) + "/";
+    CacheWriter writer;
+    SofaFeed feed(FeedSpec{"macos", "macos_data_feed",
+                           [url] { return std::vector<std::string>{url}; }, false},
+                  writer, [] {});
+    CHECK(!refreshOnce(feed));
+    writer.stop();
+
+    CHECK(feed.health().loaded);
+    CHECK(readText(cache_dir + "/macos_data_feed_hash.txt") == FeedHash::ofFile(cache));
+    DIR* listing = opendir(cache_dir.c_str());
+    CHECK(listing != nullptr);
+    while (struct dirent* entry = listing ? readdir(listing) : nullptr) {
+        CHECK_MSG(std::string(entry->d_name).find(".tmp.") == std::string::npos, entry->d_name);
+    }
+    if (listing != nullptr) {
+        closedir(listing);
+    }
+}
+
+// Another SOFA consumer renames a new cache into place. The watcher wakes
+// the engine and the next sync loads the new file, whose changed identity
+// also shows in the snapshot's fetch time.
+TEST(replacedCacheIsReloaded) {
+    TempDir temp;
+    std::string cache_dir = temp.path();
+    std::string cache = cache_dir + "/macos_data_feed.json";
+    std::string feed_text = readText(fixture_dir + "/macos_data_feed.json");
+    writeFile(cache, feed_text);
+    struct timeval old_times[2] = {{1577836800, 0}, {1577836800, 0}};
+    utimes(cache.c_str(), old_times);
+    FLAGS_macos_compatibility_cache_dir = cache_dir;
+    FLAGS_macos_compatibility_watch_cache = true;
+
+    std::atomic<int> wakes{0};
+    std::string url = "http://127.0.0.1:" + std::to_string(ReplayServer::freePort()) + "/";
+    CacheWriter writer;
+    SofaFeed feed(FeedSpec{"macos", "macos_data_feed",
+                           [url] { return std::vector<std::string>{url}; }, false},
+                  writer, [&wakes] { wakes++; });
+    CHECK(!refreshOnce(feed));
+    writer.stop();
+    std::string error;
+    auto before = feed.result(std::chrono::milliseconds(0), error);
+    CHECK(before != nullptr && before->latestOs() == "Sequoia 15");
+    CHECK(feed.health().fetched_time == 1577836800);
+
+    // Let the writes of the refresh itself settle, then replace the cache
+    usleep(500 * 1000);
+    feed.syncIfRequested();
+    wakes = 0;
+    auto identity = FileIdentity::of(cache);
+    auto replaced = nlohmann::json::parse(feed_text);
+    replaced["OSVersions"][0]["OSVersion"] = "Replaced 99";
+    writeFile(cache + ".other", replaced.dump());
+    rename((cache + ".other").c_str(), cache.c_str());
+    CHECK(!(FileIdentity::of(cache) == identity));
+
+    for (int i = 0; i < 50 && wakes == 0; i++) {
+        usleep(100 * 1000);
+    }
+    CHECK(wakes > 0);
+    feed.syncIfRequested();
+    auto after = feed.result(std::chrono::milliseconds(0), error);
+    CHECK(after != nullptr && after->latestOs() == "Replaced 99");
+    CHECK(feed.health().fetched_time > 1577836800);
+    feed.stopWatching();
+    FLAGS_macos_compatibility_watch_cache = false;
+}
+
+// How much a capped refresh may raise the test's peak RSS
+static constexpr uint64_t kMaxRefreshGrowth = 8 * 1024 * 1024;
+
+// The mirror answers the macOS feed with a body over the size cap and the
+// iOS feed with one that never ends. Both transfers must be cut off at the
+// cap and the refresh must fall back to the untouched cache.
+TEST(oversizedAndEndlessFallBackToCache) {
+    if (mirror_path.empty()) {
+        std::printf("no sofa_mirror given, skipping\n");
+        return;
+    }
+    TempDir temp;
+    std::string dir = temp.path();
+    std::string cache_dir = dir + "/cache";
+    std::string replay_dir = dir + "/replay";
+    mkdir(cache_dir.c_str(), 0755);
+    mkdir(replay_dir.c_str(), 0755);
+
+    std::string macos_feed = readText(fixture_dir + "/macos_data_feed.json");
+    std::string ios_feed = readText(fixture_dir + "/ios_data_feed.json");
+    writeFile(cache_dir + "/macos_data_feed.json", macos_feed);
+    writeFile(cache_dir + "/ios_data_feed.json", ios_feed);
+
+    HttpFixture oversized;
+    oversized.url = "http://sofa/v1/macos_data_feed.json";
+    oversized.status = 200;
+    oversized.etag = "\"oversized\"";
+    oversized.content_type = "application/json";
+    oversized.body = macos_feed;
+    writeFile(replay_dir + "/oversized.fixture", oversized.encode());
+
+    HttpFixture endless = oversized;
+    endless.url = "http://sofa/v1/ios_data_feed.json";
+    endless.etag = "\"endless\"";
+    endless.body = ios_feed;
+    endless.endless = true;
+    writeFile(replay_dir + "/endless.fixture", endless.encode());
+
+    ReplayServer server(replay_dir);
+    CHECK(server.running());
+
+    // The cap sits between the cached feeds and what the mirror sends
+    const uint64_t max_bytes = 4 * ios_feed.size();
+    CHECK(macos_feed.size() > max_bytes);
+    FLAGS_macos_compatibility_cache_dir = cache_dir;
+    FLAGS_macos_compatibility_feed_urls = server.url("/v1/macos_data_feed.json");
+    FLAGS_macos_compatibility_ios_feed_urls = server.url("/v1/ios_data_feed.json");
+    FLAGS_macos_compatibility_max_feed_bytes = max_bytes;
+
+    uint64_t peak_before = getResourceUsage().peak_rss_bytes;
+    for (FeedId id : {FeedId::kMacOS, FeedId::kIOS}) {
+        std::string error;
+        EngineSource::snapshot(id, "", error);
+    }
+    for (FeedId id : {FeedId::kMacOS, FeedId::kIOS}) {
+        SofaFeed& feed = FeedEngine::instance().feed(id);
+        for (int i = 0; i < 300 && feed.counter(SofaFeed::kRefreshes) == 0; i++) {
+            usleep(100 * 1000);
+        }
+        std::string label = feed.spec().name;
+        CHECK_MSG(feed.counter(SofaFeed::kRefreshes) == 1, label);
+
+        std::string error;
+        auto snapshot = feed.result(std::chrono::milliseconds(0), error);
+        auto health = feed.health();
+        CHECK_MSG(snapshot != nullptr, label + ": " + error);
+        CHECK_MSG(health.cache_file == cache_dir + "/" + feed.spec().stem + ".json", label);
+        CHECK_MSG(health.failures == 1, label);
+        // The cache answered, not the mirror that was asked
+        CHECK_MSG(health.source == "cache" && health.source_url.empty(), label);
+        CHECK_MSG(feed.counter(SofaFeed::kFailedRequests) == 1, label);
+        // Whatever curl had buffered when it gave up, not a stream's worth
+        CHECK_MSG(feed.downloadBytes() < 1024 * 1024, label);
+    }
+    // Starting the engine costs threads and curl state, not a feed's worth
+    // of memory per second the endless body kept streaming
+    uint64_t peak_growth = getResourceUsage().peak_rss_bytes - peak_before;
+    std::printf("peak RSS grew by %llu KiB over the refreshes\n",
+                static_cast<unsigned long long>(peak_growth / 1024));
+    CHECK(peak_growth < kMaxRefreshGrowth);
+    CHECK(readText(cache_dir + "/macos_data_feed.json") == macos_feed);
+    CHECK(readText(cache_dir + "/ios_data_feed.json") == ios_feed);
+    CHECK(server.running());
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        fixture_dir = argv[1];
+    }
+    if (argc > 2) {
+        mirror_path = argv[2];
+    }
+    return sofa_test::runAll();
+}
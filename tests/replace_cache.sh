@@ -0,0 +1,91 @@
+#!/bin/sh
+# Replaces the JSON cache under a running extension, the way another SOFA
+# consumer renames a fresh copy into place, and checks that the extension
+# reloads it with --macos_compatibility_watch_cache instead of waiting for its
+# next refresh. Linux only; exits 77 (skipped) without osqueryi.
+#
+# Usage: replace_cache.sh EXTENSION FIXTURE_DIR
+
+set -u
+
+EXTENSION=$1
+FEED=$2/macos_data_feed.json
+
+if ! command -v osqueryi >/dev/null 2>&1; then
+    echo "osqueryi not found, skipping"
+    exit 77
+fi
+
+WORK=$(mktemp -d)
+CACHE=$WORK/cache
+SOCKET=$WORK/osquery.em
+OUT=$WORK/out
+mkdir "$CACHE"
+mkfifo "$WORK/queries"
+
+cleanup() {
+    exec 3>&-
+    kill "$EXTENSION_PID" "$OSQUERY_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+
+fail() {
+    echo "FAIL: $1"
+    cat "$WORK/extension.log"
+    exit 1
+}
+
+# The initial cache is old, so its snapshot age tells it from the replacement
+cp "$FEED" "$CACHE/macos_data_feed.json"
+touch -d 2020-01-01 "$CACHE/macos_data_feed.json"
+
+osqueryi --nodisable_extensions --extensions_socket="$SOCKET" --extensions_timeout=10 \
+    <"$WORK/queries" >>"$OUT" 2>&1 &
+OSQUERY_PID=$!
+exec 3>"$WORK/queries"
+EXTENSION_PID=
+trap cleanup EXIT
+
+tries=0
+while [ ! -S "$SOCKET" ]; do
+    tries=$((tries + 1))
+    [ "$tries" -le 50 ] || fail "osqueryi did not open $SOCKET"
+    sleep 0.2
+done
+
+# No source answers, so the extension only has its cache
+"$EXTENSION" --socket="$SOCKET" --timeout=10 --interval=1 \
+    --macos_compatibility_cache_dir="$CACHE" \
+    --macos_compatibility_watch_cache \
+    --macos_compatibility_feed_urls=http://127.0.0.1:9/macos_data_feed.json \
+    >"$WORK/extension.log" 2>&1 &
+EXTENSION_PID=$!
+
+echo ".mode line" >&3
+
+# Ask for the macOS feed's snapshot age until check accepts it, at most 20s
+wait_for_age() {
+    check=$1
+    tries=0
+    while [ "$tries" -lt 20 ]; do
+        : >"$OUT"
+        echo "SELECT count(*) FROM xprotect_freshness;" >&3
+        echo "SELECT snapshot_age_seconds FROM macos_compatibility_health WHERE feed = 'macos';" >&3
+        sleep 1
+        age=$(sed -n 's/^ *snapshot_age_seconds = //p' "$OUT" | tail -n 1)
+        if [ -n "$age" ] && [ "$age" "$check" 3600 ]; then
+            return 0
+        fi
+        tries=$((tries + 1))
+    done
+    return 1
+}
+
+wait_for_age -gt || fail "the initial cache was not loaded"
+
+cp "$FEED" "$CACHE/macos_data_feed.json.new"
+mv "$CACHE/macos_data_feed.json.new" "$CACHE/macos_data_feed.json"
+
+wait_for_age -lt || fail "the replaced cache was not reloaded"
+echo "PASS"
@@ -0,0 +1,269 @@
+// Tests for sofa_core: the feed parsers and the compact index.
+//
+// Usage: sofa_core_test FIXTURE_DIR
+
+#include "check.h"
+#include "sofa_core.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <nlohmann/json.hpp>
+
+using namespace osquery;
+using json = nlohmann::json;
+
+static std::string fixture_dir = "tests/fixtures";
+
+static std::string readFixture(const std::string& name) {
+    std::ifstream in(fixture_dir + "/" + name, std::ios::binary);
+    std::ostringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+// The SAX builder is the reference every build has
+static std::shared_ptr<const SofaSnapshot> readSax(const std::string& text, std::string& error) {
+    std::istringstream in(text);
+    return SofaSnapshot::read(in, error);
+}
+
+// parse() uses the backend selected at build time. Both must accept and
+// reject the same documents and build the same index.
+static void checkBackendsAgree(const std::string& text, const std::string& label) {
+    std::string sax_error;
+    std::string parse_error;
+    std::string copy = text;
+    auto sax = readSax(text, sax_error);
+    auto parsed = SofaSnapshot::parse(copy, parse_error);
+    CHECK_MSG((sax == nullptr) == (parsed == nullptr),
+              label + " (sax: " + sax_error + ", parse: " + parse_error + ")");
+    if (sax != nullptr && parsed != nullptr) {
+        CHECK_MSG(sax->serialize() == parsed->serialize(), label);
+    }
+}
+
+static std::string escapePointer(const std::string& key) {
+    std::string escaped;
+    for (char c : key) {
+        if (c == '~') {
+            escaped += "~0";
+        } else if (c == '/') {
+            escaped += "~1";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// JSON pointers of every value in a document, containers included
+static void collectPointers(const json& value, const std::string& pointer,
+                            std::vector<std::string>& pointers) {
+    pointers.push_back(pointer);
+    if (value.is_object()) {
+        for (const auto& item : value.items()) {
+            collectPointers(item.value(), pointer + "/" + escapePointer(item.key()), pointers);
+        }
+    } else if (value.is_array()) {
+        for (size_t i = 0; i < value.size(); i++) {
+            collectPointers(value[i], pointer + "/" + std::to_string(i), pointers);
+        }
+    }
+}
+
+// Replace each value of the feed in turn with one of another type
+static void checkWrongTypes(const json& feed) {
+    static const json kReplacements[] = {nullptr, -1, 2.5, "x", json::array(), json::object()};
+    std::vector<std::string> pointers;
+    collectPointers(feed, "", pointers);
+    for (const auto& pointer : pointers) {
+        for (const auto& replacement : kReplacements) {
+            json mutated = feed;
+            mutated[json::json_pointer(pointer)] = replacement;
+            checkBackendsAgree(mutated.dump(), pointer + " = " + replacement.dump());
+        }
+    }
+}
+
+// The macOS fixture cut down to a few models so every value can be mutated
+static json smallMacOSFeed() {
+    json feed = json::parse(readFixture("macos_data_feed.json"));
+    json models = json::object();
+    for (const auto& item : feed["Models"].items()) {
+        if (models.size() == 3) {
+            break;
+        }
+        models[item.key()] = item.value();
+    }
+    feed["Models"] = models;
+    for (auto& os : feed["OSVersions"]) {
+        os.erase("SupportedModels");
+        for (auto& update : os["SecurityReleases"]) {
+            update.erase("CVEs");
+        }
+    }
+    return feed;
+}
+
+static std::vector<std::string_view> toVector(OsList list) {
+    return {list.begin(), list.end()};
+}
+
+TEST(fixturesParseAlike) {
+    for (const char* name : {"macos_data_feed.json", "ios_data_feed.json"}) {
+        std::string text = readFixture(name);
+        CHECK_MSG(!text.empty(), name);
+        checkBackendsAgree(text, name);
+    }
+
+    std::string error;
+    auto snapshot = readSax(readFixture("macos_data_feed.json"), error);
+    CHECK(snapshot != nullptr);
+    if (snapshot == nullptr) {
+        return;
+    }
+    CHECK(!snapshot->latestOs().empty());
+    CHECK(!snapshot->modelIdentifiers().empty());
+    CHECK(!snapshot->xprotect().empty());
+    const auto* latest = snapshot->release(snapshot->latestOs());
+    CHECK(latest != nullptr && latest->security_count > 0);
+    if (latest != nullptr) {
+        auto delta = snapshot->cvesSince(*latest, 0);
+        CHECK(delta.cves > 0);
+        CHECK(delta.exploited > 0);
+    }
+}
+
+TEST(wrongTypesParseAlike) {
+    checkWrongTypes(smallMacOSFeed());
+    checkWrongTypes(json::parse(readFixture("ios_data_feed.json")));
+}
+
+TEST(wrongTypesAreSkipped) {
+    json feed = smallMacOSFeed();
+    feed["XProtectPlistConfigData"]["ReleaseDate"] = nullptr;
+    feed["OSVersions"][0]["SecurityReleases"][0]["UniqueCVEsCount"] = nullptr;
+    feed["OSVersions"][0]["SecurityReleases"][1]["UniqueCVEsCount"] = -4;
+    std::string removed = feed["Models"].begin().key();
+    feed["Models"][removed] = nullptr;
+
+    std::string text = feed.dump();
+    std::string error;
+    auto snapshot = SofaSnapshot::parse(text, error);
+    CHECK_MSG(snapshot != nullptr, error);
+    if (snapshot == nullptr) {
+        return;
+    }
+    CHECK(snapshot->supportedOs(removed).empty());
+    CHECK(snapshot->modelIdentifiers().size() == 2);
+    bool has_plist_config = false;
+    for (const auto& component : snapshot->xprotect()) {
+        if (component.section == "XProtectPlistConfigData") {
+            has_plist_config = true;
+            CHECK(component.date.empty());
+        }
+    }
+    CHECK(has_plist_config);
+    const auto* latest = snapshot->release(snapshot->latestOs());
+    CHECK(latest != nullptr);
+    if (latest != nullptr) {
+        const auto& updates = feed["OSVersions"][0]["SecurityReleases"];
+        uint32_t expected = 0;
+        for (size_t i = 2; i < updates.size(); i++) {
+            expected += updates[i].value("UniqueCVEsCount", 0u);
+        }
+        CHECK(snapshot->cvesSince(*latest, 0).cves == expected);
+    }
+}
+
+TEST(indexRoundTrip) {
+    for (const char* name : {"macos_data_feed.json", "ios_data_feed.json"}) {
+        std::string error;
+        auto snapshot = readSax(readFixture(name), error);
+        CHECK_MSG(snapshot != nullptr, error);
+        if (snapshot == nullptr) {
+            continue;
+        }
+        std::string index = snapshot->serialize();
+        auto decoded = SofaSnapshot::deserialize(index, error);
+        CHECK_MSG(decoded != nullptr, error);
+        if (decoded == nullptr) {
+            continue;
+        }
+        CHECK_MSG(decoded->serialize() == index, name);
+        CHECK(decoded->latestOs() == snapshot->latestOs());
+        CHECK(decoded->xprotect().size() == snapshot->xprotect().size());
+
+        // parse() recognises the index too
+        std::string copy = index;
+        auto reparsed = SofaSnapshot::parse(copy, error);
+        CHECK(reparsed != nullptr && reparsed->serialize() == index);
+    }
+}
+
+TEST(corruptNameCountIsRejected) {
+    std::string error;
+    auto snapshot = readSax(readFixture("macos_data_feed.json"), error);
+    CHECK_MSG(snapshot != nullptr, error);
+    if (snapshot == nullptr) {
+        return;
+    }
+    // The name count follows the magic and the latest OS string
+    std::string index = snapshot->serialize();
+    size_t offset = SofaSnapshot::kIndexMagic.size() + 4 + snapshot->latestOs().size();
+    CHECK(offset + 4 <= index.size());
+    for (uint32_t count : {0xffffffffu, static_cast<uint32_t>(index.size())}) {
+        std::string corrupt = index;
+        for (int i = 0; i < 4; i++) {
+            corrupt[offset + i] = static_cast<char>(count >> (8 * i));
+        }
+        CHECK_MSG(SofaSnapshot::deserialize(corrupt, error) == nullptr, std::to_string(count));
+    }
+}
+
+TEST(modelSliceRoundTrip) {
+    std::string error;
+    auto snapshot = readSax(readFixture("macos_data_feed.json"), error);
+    CHECK_MSG(snapshot != nullptr, error);
+    if (snapshot == nullptr) {
+        return;
+    }
+    for (auto identifier : snapshot->modelIdentifiers()) {
+        std::string slice = snapshot->serializeModel(identifier);
+        auto decoded = SofaSnapshot::deserialize(slice, error);
+        CHECK_MSG(decoded != nullptr, std::string(identifier) + ": " + error);
+        if (decoded == nullptr) {
+            continue;
+        }
+        CHECK(decoded->modelIdentifiers().size() == 1);
+        CHECK(toVector(decoded->supportedOs(identifier)) ==
+              toVector(snapshot->supportedOs(identifier)));
+        CHECK(decoded->supportedReleases(identifier).size ==
+              snapshot->supportedReleases(identifier).size);
+        CHECK(decoded->latestOs() == snapshot->latestOs());
+    }
+
+    auto unknown = SofaSnapshot::deserialize(snapshot->serializeModel("NoSuchModel1,1"), error);
+    CHECK(unknown != nullptr && unknown->modelIdentifiers().empty());
+
+    // Every truncation of an index is rejected rather than misread
+    std::string slice = snapshot->serializeModel(snapshot->modelIdentifiers().front());
+    for (size_t size = 0; size < slice.size(); size++) {
+        CHECK_MSG(SofaSnapshot::deserialize(std::string_view(slice).substr(0, size), error) ==
+                      nullptr,
+                  std::to_string(size));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        fixture_dir = argv[1];
+    }
+#ifdef MACOS_COMPATIBILITY_SIMDJSON
+    std::printf("parse() backend: simdjson\n");
+#else
+    std::printf("parse() backend: nlohmann_json, the same as the SAX reader\n");
+#endif
+    return sofa_test::runAll();
+}